@@ -0,0 +1,371 @@
+/* unzipflow.c -- streaming unzipper
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include "zlib.h"
+#include "unzipflow.h"
+
+// Maximum four-byte field value.
+#define MAX32 0xffffffff
+
+// Input and output buffer sizes. The input buffer holds a complete local
+// header, with the longest name and extra field, and the data descriptor and
+// following signature.
+#define IN 262144
+#define OUT 262144
+
+// Get little-endian integers.
+#define GET2(p) ((p)[0] + ((unsigned)(p)[1] << 8))
+#define GET4(p) (GET2(p) + ((uint32_t)GET2((p) + 2) << 16))
+#define GET8(p) (GET4(p) + ((uint64_t)GET4((p) + 4) << 32))
+
+// unzip state. The input is read into buf, where the unread bytes are
+// buf[next..have-1]. strm is an inflate engine that is reused for each entry.
+typedef struct {
+    void *handle;               // user opaque pointer for get() function
+    size_t (*get)(void *, void *, size_t);  // read streaming data
+    FILE *in;                   // input file for streaming data
+    unsigned char *buf;         // input buffer
+    size_t next;                // offset of the next unread byte in buf
+    size_t have;                // number of bytes in buf
+    int eof;                    // true if get() has reached the end
+    uint64_t off;               // offset in zip file of buf[next]
+    unsigned char *out;         // inflate output buffer
+    char *name;                 // current entry name
+    uint32_t id;                // constant identifier for validity check
+    int ran;                    // true if unzip_run() was called
+    void *hook;                 // user opaque pointer for the callbacks
+    int (*data)(void *, void const *, size_t);  // deliver entry data
+    z_stream strm;              // re-useable inflate engine
+} unz_t;
+
+// Constant in unz_t for validity check.
+#define ID 2583108173
+
+// Default get() function for reading from the file unz->in.
+static size_t unz_read(void *handle, void *buf, size_t len) {
+    unz_t *unz = (unz_t *)handle;
+    return fread(buf, 1, len, unz->in);
+}
+
+// Assure that at least want bytes are available at unz->buf + unz->next, if
+// possible. want must be no more than IN. Return the number of bytes
+// available, which is less than want only at the end of the input.
+static size_t unz_fill(unz_t *unz, size_t want) {
+    size_t avail = unz->have - unz->next;
+    if (avail >= want || unz->eof)
+        return avail;
+    memmove(unz->buf, unz->buf + unz->next, avail);
+    unz->next = 0;
+    unz->have = avail;
+    while (unz->have < want && !unz->eof) {
+        size_t room = IN - unz->have;
+        size_t got = unz->get(unz->handle, unz->buf + unz->have, room);
+        unz->have += got;
+        unz->eof = got < room;
+    }
+    return unz->have;
+}
+
+// Consume len bytes of the input, which must be available.
+static void unz_used(unz_t *unz, size_t len) {
+    unz->next += len;
+    unz->off += len;
+}
+
+// Read the len bytes of stored data, delivering them if deliver, and updating
+// the CRC-32 and lengths in entry. Return the status.
+static int unz_copy(unz_t *unz, unzip_entry_t *entry, uint64_t len,
+                    int deliver) {
+    while (len) {
+        size_t avail = unz_fill(unz, 1);
+        if (avail == 0)
+            return UNZIP_READ;
+        size_t n = len < avail ? (size_t)len : avail;
+        unsigned char const *p = unz->buf + unz->next;
+        entry->crc = crc32_z(entry->crc, p, n);
+        if (deliver && unz->data(unz->hook, p, n))
+            return UNZIP_ABORT;
+        unz_used(unz, n);
+        entry->clen += n;
+        entry->ulen += n;
+        len -= n;
+    }
+    return UNZIP_OK;
+}
+
+// Inflate the deflate data of the entry up to and including its end marker,
+// delivering the uncompressed data if deliver, and updating the CRC-32 and
+// lengths in entry. The input following the end marker is left in buf.
+// Return the status.
+static int unz_inflate(unz_t *unz, unzip_entry_t *entry, int deliver) {
+    inflateReset(&unz->strm);
+    int ret;
+    do {
+        size_t avail = unz_fill(unz, 1);
+        if (avail == 0)
+            return UNZIP_READ;
+        unsigned in = avail > UINT_MAX ? UINT_MAX : (unsigned)avail;
+        unz->strm.next_in = unz->buf + unz->next;
+        unz->strm.avail_in = in;
+        do {
+            unz->strm.next_out = unz->out;
+            unz->strm.avail_out = OUT;
+            ret = inflate(&unz->strm, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR ||
+                ret == Z_MEM_ERROR)
+                return UNZIP_DATA;
+            size_t n = OUT - unz->strm.avail_out;
+            entry->crc = crc32_z(entry->crc, unz->out, n);
+            entry->ulen += n;
+            if (deliver && n && unz->data(unz->hook, unz->out, n))
+                return UNZIP_ABORT;
+        } while (unz->strm.avail_out == 0 && ret != Z_STREAM_END);
+        size_t used = in - unz->strm.avail_in;
+        unz_used(unz, used);
+        entry->clen += used;
+    } while (ret != Z_STREAM_END);
+    return UNZIP_OK;
+}
+
+// Return true if the four bytes at p are a signature of a zip header or
+// record that can follow an entry.
+static int unz_sig(unsigned char const *p) {
+    uint32_t sig = GET4(p);
+    return sig == 0x04034b50 ||     // local header
+           sig == 0x02014b50 ||     // central directory header
+           sig == 0x05054b50 ||     // digital signature
+           sig == 0x06064b50 ||     // zip64 end record
+           sig == 0x06054b50;       // end record
+}
+
+// Read the data descriptor following the entry data, and compare it to the
+// CRC-32 and lengths in got, from reading the data. The signature is
+// optional, and the lengths can be four or eight bytes each. zipflow uses
+// eight when the local header offset needs them, even if the lengths don't,
+// so both are tried, with the following signature deciding when both match.
+// Return the status.
+static int unz_desc(unz_t *unz, unzip_entry_t const *got) {
+    size_t avail = unz_fill(unz, 28);
+    unsigned char const *p = unz->buf + unz->next;
+    size_t sig = avail >= 4 && GET4(p) == 0x08074b50 ? 4 : 0;
+    if (avail < sig + 12)
+        return UNZIP_READ;
+    p += sig;
+    int len32 = GET4(p + 4) == got->clen && GET4(p + 8) == got->ulen;
+    int len64 = avail >= sig + 20 &&
+                GET8(p + 4) == got->clen && GET8(p + 12) == got->ulen;
+    size_t len;
+    if (len32 && (!len64 || avail < sig + 16 || unz_sig(p + 12)))
+        len = 12;
+    else if (len64 || got->clen >= MAX32 || got->ulen >= MAX32)
+        len = 20;
+    else
+        len = 12;
+    if (avail < sig + len)
+        return UNZIP_READ;
+    unz_used(unz, sig + len);
+    return !len32 && !len64 ? UNZIP_LENGTH :
+           GET4(p) != got->crc ? UNZIP_CRC : UNZIP_OK;
+}
+
+// Read the local header at the current position into entry. The signature has
+// already been checked. Return the status.
+static int unz_local(unz_t *unz, unzip_entry_t *entry) {
+    if (unz_fill(unz, 30) < 30)
+        return UNZIP_READ;
+    unsigned char const *p = unz->buf + unz->next;
+    size_t nlen = GET2(p + 26), xlen = GET2(p + 28);
+    if (unz_fill(unz, 30 + nlen + xlen) < 30 + nlen + xlen)
+        return UNZIP_READ;
+    p = unz->buf + unz->next;
+    entry->off = unz->off;
+    entry->flags = GET2(p + 6);
+    entry->method = GET2(p + 8);
+    entry->dos = GET2(p + 10) + ((uint32_t)GET2(p + 12) << 16);
+    entry->crc = GET4(p + 14);
+    entry->clen = GET4(p + 18);
+    entry->ulen = GET4(p + 22);
+    entry->known = (entry->flags & 8) == 0;
+    memcpy(unz->name, p + 30, nlen);
+    unz->name[nlen] = 0;
+    entry->name = unz->name;
+    entry->nlen = nlen;
+
+    // Get the lengths from a zip64 extended information field, if needed.
+    unsigned char const *x = p + 30 + nlen, *end = x + xlen;
+    while (end - x >= 4) {
+        unsigned id = GET2(x), len = GET2(x + 2);
+        x += 4;
+        if (len > (size_t)(end - x))
+            break;
+        if (id == 1) {
+            unsigned char const *q = x;
+            if (entry->ulen == MAX32 && len >= 8) {
+                entry->ulen = GET8(q);
+                q += 8;
+            }
+            if (entry->clen == MAX32 && len >= (size_t)(q - x) + 8)
+                entry->clen = GET8(q);
+        }
+        x += len;
+    }
+    unz_used(unz, 30 + nlen + xlen);
+    return UNZIP_OK;
+}
+
+// See comments in unzipflow.h.
+UNZIP *unzip_pull(void *handle,
+                  size_t (*get)(void *handle, void *buf, size_t len)) {
+    if (get == NULL)
+        return NULL;
+    unz_t *unz = malloc(sizeof(unz_t));
+    assert(unz != NULL && "out of memory");
+    unz->handle = handle;
+    unz->get = get;
+    unz->in = NULL;
+    unz->buf = malloc(IN);
+    unz->out = malloc(OUT);
+    unz->name = malloc(65536);
+    assert(unz->buf != NULL && unz->out != NULL && unz->name != NULL &&
+           "out of memory");
+    unz->next = 0;
+    unz->have = 0;
+    unz->eof = 0;
+    unz->off = 0;
+    unz->id = ID;
+    unz->ran = 0;
+    unz->hook = NULL;
+    unz->data = NULL;
+    unz->strm.zalloc = Z_NULL;
+    unz->strm.zfree = Z_NULL;
+    unz->strm.opaque = Z_NULL;
+    unz->strm.next_in = Z_NULL;
+    unz->strm.avail_in = 0;
+    int ret = inflateInit2(&unz->strm, -15);
+    assert(ret == Z_OK && "out of memory");
+    (void)ret;
+    return (UNZIP *)unz;
+}
+
+// See comments in unzipflow.h.
+UNZIP *unzip_open(FILE *in) {
+    if (in == NULL)
+        return NULL;
+    unz_t *unz = unzip_pull(NULL, unz_read);
+    unz->handle = unz;
+    unz->in = in;
+    return (UNZIP *)unz;
+}
+
+// See comments in unzipflow.h.
+int unzip_run(UNZIP *ptr, void *hook,
+              int (*start)(void *hook, unzip_entry_t const *entry),
+              int (*data)(void *hook, void const *ptr, size_t len),
+              void (*done)(void *hook, unzip_entry_t const *entry,
+                           int status)) {
+    unz_t *unz = (unz_t *)ptr;
+    if (unz == NULL || unz->id != ID || unz->ran || start == NULL ||
+        data == NULL)
+        return -1;
+    unz->ran = 1;
+    unz->hook = hook;
+    unz->data = data;
+    int last = UNZIP_OK;
+    for (;;) {
+        // Check the signature of the next header. Stop at the central
+        // directory, or at the end record if there are no entries. Skip the
+        // marker at the start of a split or spanned zip file.
+        if (unz_fill(unz, 4) < 4)
+            return UNZIP_READ;
+        uint32_t sig = GET4(unz->buf + unz->next);
+        if (sig == 0x02014b50 || sig == 0x06054b50 || sig == 0x06064b50)
+            return last;
+        if (sig == 0x08074b50 && unz->off == 0) {
+            unz_used(unz, 4);
+            continue;
+        }
+        if (sig != 0x04034b50)
+            return UNZIP_FORMAT;
+
+        // Read the local header, and offer the entry.
+        unzip_entry_t entry;
+        int status = unz_local(unz, &entry);
+        if (status != UNZIP_OK)
+            return status;
+        int ret = start(hook, &entry);
+        if (ret == -1)
+            return UNZIP_ABORT;
+
+        // Read the entry data, and the data descriptor, if any, verifying
+        // the CRC-32 and lengths.
+        unzip_entry_t got = entry;
+        got.crc = crc32(0, Z_NULL, 0);
+        got.clen = 0;
+        got.ulen = 0;
+        got.known = 1;
+        if ((entry.flags & 1) || (entry.method != 0 && entry.method != 8)) {
+            // Encrypted or an unsupported method. Skip it if possible.
+            if (!entry.known)
+                status = UNZIP_END;
+            else {
+                status = unz_copy(unz, &got, entry.clen, 0);
+                got = entry;
+                if (status == UNZIP_OK)
+                    status = UNZIP_METHOD;
+            }
+        }
+        else if (entry.method == 0)
+            status = entry.known ? unz_copy(unz, &got, entry.clen, ret == 0) :
+                                   UNZIP_END;
+        else
+            status = unz_inflate(unz, &got, ret == 0);
+        if (status == UNZIP_OK) {
+            if (!entry.known)
+                status = unz_desc(unz, &got);
+            else if (got.clen != entry.clen || got.ulen != entry.ulen)
+                status = UNZIP_LENGTH;
+            else if (got.crc != entry.crc)
+                status = UNZIP_CRC;
+        }
+        if (done != NULL && status != UNZIP_ABORT)
+            done(hook, &got, status);
+        if (status != UNZIP_OK) {
+            last = status;
+            if (status > UNZIP_METHOD)
+                return status;
+        }
+    }
+}
+
+// See comments in unzipflow.h.
+char const *unzip_reason(int code) {
+    static char const *reason[UNZIP_CODES] = {
+        "OK", "bad CRC-32", "bad length", "skipped (encrypted or method)",
+        "invalid deflate data", "end cannot be found", "format error",
+        "read error", "aborted", "skipped (unsafe name)", "write error",
+        "replaced by a later entry"
+    };
+    return code < 0 || code >= UNZIP_CODES ? NULL : reason[code];
+}
+
+// See comments in unzipflow.h.
+int unzip_close(UNZIP *ptr) {
+    unz_t *unz = (unz_t *)ptr;
+    if (unz == NULL || unz->id != ID)
+        return -1;
+    inflateEnd(&unz->strm);
+    free(unz->name);
+    free(unz->out);
+    free(unz->buf);
+    unz->id = 0;
+    free(unz);
+    return 0;
+}
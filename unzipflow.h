@@ -0,0 +1,153 @@
+/* unzipflow.h -- streaming unzipper
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+// unzipflow is the streaming counterpart of zipflow. It reads a zip file
+// forward only, from a FILE * or an input function, and delivers the entries
+// through callbacks as their local headers and data are read. It never seeks,
+// and stops at the central directory without reading it. The end of each
+// deflated entry is found by inflating it, and a data descriptor, if present,
+// is checked against the inflated data, in its 32-bit or 64-bit form. The
+// memory used is small and constant, about 600 KiB, no matter how large the
+// zip file or its entries. When compiling, link with zlib (-lz).
+
+// Basic usage:
+//
+//      int start(void *hook, unzip_entry_t const *entry) {
+//          printf("%s\n", entry->name);
+//          return 0;
+//      }
+//      int data(void *hook, void const *ptr, size_t len) {
+//          return fwrite(ptr, 1, len, (FILE *)hook) < len;
+//      }
+//
+//      UNZIP *unz = unzip_open(infile);
+//      int ret = unzip_run(unz, stdout, start, data, NULL);
+//      unzip_close(unz);
+//
+// That lists the names of the entries in infile on stdout, each followed by
+// its uncompressed data.
+
+// Only what can be read from a stream is available: the names, lengths,
+// CRC-32s, and DOS modification times of the entries. The attributes and any
+// timestamp extra fields written by zipflow are only in the central
+// directory. Entries that are encrypted, or that use a compression method
+// other than stored or deflate, can be skipped, but not read, as long as
+// their lengths are in the local header. Otherwise the end of such an entry
+// cannot be found, and the streaming stops. zipflow's encrypted entries
+// without zip_known() or zip_seek() are like that.
+
+#ifndef UNZIPFLOW_H
+#define UNZIPFLOW_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void UNZIP;         // opaque structure for zip streaming input
+
+// Entry information from the local header, as provided to start() and done().
+// For done(), the CRC-32 and lengths are those of the data actually read.
+typedef struct {
+    char const *name;       // entry name, zero-terminated
+    size_t nlen;            // length of the name
+    uint64_t off;           // offset of the local header in the zip file
+    unsigned method;        // compression method (0 stored, 8 deflate)
+    unsigned flags;         // general purpose bit flags
+    uint32_t dos;           // DOS modification date (high) and time (low)
+    uint32_t crc;           // CRC-32, if known (see below)
+    uint64_t clen;          // compressed length, if known
+    uint64_t ulen;          // uncompressed length, if known
+    int known;              // true if crc, clen, and ulen are known
+} unzip_entry_t;
+
+// Entry and stream status codes, provided to done() and returned by
+// unzip_run(). The ones after UNZIP_METHOD end the streaming.
+enum {
+    UNZIP_OK,       // entry read and verified
+    UNZIP_CRC,      // CRC-32 does not match
+    UNZIP_LENGTH,   // a length does not match
+    UNZIP_METHOD,   // encrypted or unsupported method -- skipped
+    UNZIP_DATA,     // invalid deflate data
+    UNZIP_END,      // end of a stored or unsupported entry cannot be found
+    UNZIP_FORMAT,   // not a zip file header where one is expected
+    UNZIP_READ,     // read error or premature end of the zip file
+    UNZIP_ABORT,    // aborted by start() or data()
+    UNZIP_NAME,     // unsafe entry name -- skipped (unzip_extract() only)
+    UNZIP_WRITE,    // output error (unzip_extract() only)
+    UNZIP_SAME,     // replaced by a later entry (unzip_extract() only)
+    UNZIP_CODES     // (number of status codes)
+};
+
+// Return a short constant description of the status code, or NULL if code is
+// not valid.
+char const *unzip_reason(int code);
+
+// Return the unzip state to read a zip file from in, which on systems where it
+// matters must be in binary mode. NULL is returned if in is NULL.
+UNZIP *unzip_open(FILE *in);
+
+// Like unzip_open(), but instead of a FILE *, register the function get() for
+// the streaming zip file input. get() reads up to len bytes into buf, and
+// returns the number of bytes read, which is less than len only at the end of
+// the input or on an error. handle is passed to get() on each call. NULL is
+// returned if get is NULL.
+UNZIP *unzip_pull(void *handle,
+                  size_t (*get)(void *handle, void *buf, size_t len));
+
+// Read the zip file, calling start() at each local header with the entry
+// information, and then data() with each piece of the entry's uncompressed
+// data, and then done(), if not NULL, with the entry information as read and
+// the entry's status. If start() returns 1, the entry's data is read and
+// verified, but not delivered to data(). If start() returns -1, or data()
+// returns non-zero, then the streaming is aborted. Entries continue to be
+// read after an entry with a status of UNZIP_METHOD or less. The streaming
+// stops without error at the central directory. hook is passed to the
+// callbacks on each call. entry, its name, and data are only valid during a
+// call, and must be copied if they are to be retained. unzip_run() can only
+// be called once for an unzip state. 0 is returned if all of the entries were
+// read and verified. Otherwise the last status that was not UNZIP_OK is
+// returned. -1 is returned if unz, start, or data are not valid.
+int unzip_run(UNZIP *unz, void *hook,
+              int (*start)(void *hook, unzip_entry_t const *entry),
+              int (*data)(void *hook, void const *ptr, size_t len),
+              void (*done)(void *hook, unzip_entry_t const *entry,
+                           int status));
+
+// Free the unzip state. It does not close the FILE * given to unzip_open().
+// On success, 0 is returned. If unz is not valid, then -1 is returned.
+int unzip_close(UNZIP *unz);
+
+// Extract all of the entries of the zip file at path into the existing
+// directory dir, using threads threads, or one per core if threads is 0. This
+// is not streaming. It is in unzipmt.c, which needs POSIX and pthreads (link
+// with -lz -lpthread). The zip file is mapped into memory, its central
+// directory is found from the end records, including zip64, and the entries
+// are inflated in parallel, each thread taking the next entry not yet taken.
+// The directories are made first. Each file is preallocated where possible,
+// and its mode, when made on Unix, and modification time, from a timestamp
+// extra field if present, are set on the open file before it is closed. The
+// directory entries get theirs after all of the files are written. Entries
+// with an absolute path or a .. component are not extracted, and give
+// UNZIP_NAME. A file whose data fails to extract or verify is removed. If more
+// than one entry has the same name, as zip_append() can make, then only the
+// last one in the central directory is extracted, and the others give
+// UNZIP_SAME. diag(), if not NULL, is called with hook, each entry name, and
+// its status, as they complete. The calls are from the extraction threads, but
+// only one at a time. 0 is returned if all of the entries were extracted and
+// verified, other than those replaced. Otherwise the last status that was not
+// UNZIP_OK or UNZIP_SAME is returned, or UNZIP_READ or UNZIP_FORMAT if the zip
+// file could not be mapped or its central directory not found. -1 is returned
+// if path or dir is NULL or threads is negative.
+int unzip_extract(char const *path, char const *dir, int threads, void *hook,
+                  void (*diag)(void *hook, char const *name, int status));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
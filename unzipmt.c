@@ -0,0 +1,521 @@
+/* unzipmt.c -- parallel unzipper
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+// unzip_extract() from unzipflow.h. This requires POSIX, for mmap() and
+// threads. Link with -lz -lpthread.
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE           // for fallocate()
+#endif
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "zlib.h"
+#include "unzipflow.h"
+
+// Maximum two and four-byte field values.
+#define MAX16 0xffff
+#define MAX32 0xffffffff
+
+// Output buffer size for inflate.
+#define OUT 262144
+
+// Get little-endian integers.
+#define GET2(p) ((p)[0] + ((unsigned)(p)[1] << 8))
+#define GET4(p) (GET2(p) + ((uint32_t)GET2((p) + 2) << 16))
+#define GET8(p) (GET4(p) + ((uint64_t)GET4((p) + 4) << 32))
+
+// Extraction state shared by the threads. The zip file is mapped into memory,
+// and the central directory is indexed with a pointer to each header. Each
+// thread takes the next entry to extract from next.
+typedef struct {
+    unsigned char const *map;   // zip file mapped into memory
+    size_t size;                // length of the zip file
+    size_t base;                // offset in the map of the start of the zip
+    unsigned char const **cent; // central directory header of each entry
+    size_t num;                 // number of entries
+    atomic_size_t next;         // next entry to extract
+    int dir;                    // output directory
+    void *hook;                 // user opaque pointer for diag() function
+    void (*diag)(void *, char const *, int);    // entry status function
+    pthread_mutex_t lock;       // lock for diag() and status
+    int status;                 // last entry status that was not UNZIP_OK
+} ext_t;
+
+// Entry information from a central directory header.
+typedef struct {
+    char name[65536];           // entry name, zero-terminated
+    size_t nlen;                // length of the name
+    unsigned method;            // compression method
+    unsigned flags;             // general purpose bit flags
+    uint32_t crc;               // CRC-32 of the uncompressed data
+    uint64_t clen;              // compressed length
+    uint64_t ulen;              // uncompressed length
+    uint64_t off;               // offset of the local header
+    unsigned mode;              // Unix permissions, or 0 if none
+    time_t mtime;               // modification time
+} ent_t;
+
+// Report the status of the entry name, and keep the last status that was not
+// UNZIP_OK.
+static void ext_report(ext_t *ext, char const *name, int status) {
+    pthread_mutex_lock(&ext->lock);
+    if (status != UNZIP_OK && status != UNZIP_SAME)
+        ext->status = status;
+    if (ext->diag != NULL)
+        ext->diag(ext->hook, name, status);
+    pthread_mutex_unlock(&ext->lock);
+}
+
+// Convert the DOS date and time to a time_t, as local time.
+static time_t ext_dos(unsigned date, unsigned time) {
+    struct tm tm = {0};
+    tm.tm_year = (date >> 9) + 80;
+    tm.tm_mon = ((date >> 5) & 0xf) - 1;
+    tm.tm_mday = date & 0x1f;
+    tm.tm_hour = time >> 11;
+    tm.tm_min = (time >> 5) & 0x3f;
+    tm.tm_sec = (time & 0x1f) << 1;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Get the entry information from the central directory header at p, which has
+// been checked to be within the central directory.
+static void ext_central(unsigned char const *p, ent_t *ent) {
+    ent->flags = GET2(p + 8);
+    ent->method = GET2(p + 10);
+    ent->crc = GET4(p + 16);
+    ent->clen = GET4(p + 20);
+    ent->ulen = GET4(p + 24);
+    ent->nlen = GET2(p + 28);
+    ent->off = GET4(p + 42);
+    ent->mode = p[5] == 3 ? (GET4(p + 38) >> 16) & 07777 : 0;
+    memcpy(ent->name, p + 46, ent->nlen);
+    ent->name[ent->nlen] = 0;
+
+    // Get the zip64 lengths and offset, and a Unix modification time, from
+    // the extra fields. mktime() for the DOS time is avoided if possible,
+    // since it takes a lock.
+    int stamp = 0;
+    unsigned char const *x = p + 46 + ent->nlen, *end = x + GET2(p + 30);
+    while (end - x >= 4) {
+        unsigned id = GET2(x), len = GET2(x + 2);
+        x += 4;
+        if (len > (size_t)(end - x))
+            break;
+        unsigned char const *q = x, *last = x + len;
+        if (id == 1) {                          // zip64 information
+            if (ent->ulen == MAX32 && last - q >= 8) {
+                ent->ulen = GET8(q);
+                q += 8;
+            }
+            if (ent->clen == MAX32 && last - q >= 8) {
+                ent->clen = GET8(q);
+                q += 8;
+            }
+            if (ent->off == MAX32 && last - q >= 8)
+                ent->off = GET8(q);
+        }
+        else if (id == 13 && len >= 8) {        // PKWare Unix
+            ent->mtime = (time_t)GET4(q + 4);
+            stamp = 1;
+        }
+        else if (id == 0x5455 && len >= 5 && (q[0] & 1)) {  // Info-ZIP UT
+            ent->mtime = (time_t)(int32_t)GET4(q + 1);
+            stamp = 1;
+        }
+        else if (id == 10 && len >= 32 && GET2(q + 4) == 1 &&
+                 GET2(q + 6) >= 24) {           // NTFS
+            ent->mtime = (time_t)(GET8(q + 8) / 10000000 - 11644473600);
+            stamp = 1;
+        }
+        x += len;
+    }
+    if (!stamp)
+        ent->mtime = ext_dos(GET2(p + 14), GET2(p + 12));
+}
+
+// Return true if name is a relative path with no .. components, which is
+// safe to create under the output directory.
+static int ext_safe(char const *name) {
+    if (*name == 0 || *name == '/')
+        return 0;
+    char const *p = name;
+    for (;;) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0))
+            return 0;
+        p = strchr(p, '/');
+        if (p == NULL)
+            return 1;
+        p++;
+    }
+}
+
+// Write the len bytes at buf to fd. Return true on error.
+static int ext_write(int fd, unsigned char const *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Extract the entry ent to fd, using strm and out for inflation. Return the
+// status.
+static int ext_data(ext_t *ext, ent_t const *ent, int fd, z_stream *strm,
+                    unsigned char *out) {
+    // Find the data after the local header, whose name and extra field
+    // lengths can differ from the central header's.
+    size_t at = ext->base + ent->off;
+    if (ent->off > ext->size || at > ext->size - 30)
+        return UNZIP_FORMAT;
+    unsigned char const *p = ext->map + at;
+    if (GET4(p) != 0x04034b50)
+        return UNZIP_FORMAT;
+    at += 30 + GET2(p + 26) + GET2(p + 28);
+    if (at > ext->size || ent->clen > ext->size - at)
+        return UNZIP_FORMAT;
+    unsigned char const *data = ext->map + at;
+
+    // Preallocate the file, if possible. ulen is not trusted, so the space is
+    // limited to what clen could expand to (deflate's maximum is 1032:1), and
+    // the file size is left to be set by what is actually written.
+#ifdef __linux__
+    uint64_t most = ent->method == 0 ? ent->clen :
+                    ent->clen > UINT64_MAX / 1032 ? UINT64_MAX :
+                    ent->clen * 1032;
+    uint64_t want = ent->ulen < most ? ent->ulen : most;
+    if (want && want <= INT64_MAX)
+        (void)fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)want);
+#endif
+
+    // Copy or inflate the data, computing the CRC-32.
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    uint64_t ulen = 0;
+    if (ent->method == 0) {
+        uint64_t left = ent->clen;
+        while (left) {
+            size_t n = left > OUT ? OUT : (size_t)left;
+            crc = crc32_z(crc, data, n);
+            if (ext_write(fd, data, n))
+                return UNZIP_WRITE;
+            data += n;
+            left -= n;
+        }
+        ulen = ent->clen;
+    }
+    else {
+        inflateReset(strm);
+        uint64_t left = ent->clen;
+        strm->next_in = (unsigned char *)(uintptr_t)data;   // awful hack
+        strm->avail_in = 0;
+        int ret;
+        do {
+            if (strm->avail_in == 0) {
+                if (left == 0)
+                    return UNZIP_DATA;  // ran out of compressed data
+                strm->avail_in = left > UINT_MAX ? UINT_MAX : (unsigned)left;
+                left -= strm->avail_in;
+            }
+            strm->next_out = out;
+            strm->avail_out = OUT;
+            ret = inflate(strm, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR ||
+                ret == Z_MEM_ERROR)
+                return UNZIP_DATA;
+            size_t n = OUT - strm->avail_out;
+            crc = crc32_z(crc, out, n);
+            ulen += n;
+            if (ext_write(fd, out, n))
+                return UNZIP_WRITE;
+        } while (ret != Z_STREAM_END);
+        if (left || strm->avail_in)
+            return UNZIP_LENGTH;
+    }
+    return ulen != ent->ulen ? UNZIP_LENGTH :
+           crc != ent->crc ? UNZIP_CRC : UNZIP_OK;
+}
+
+// Extract entries until there are none left.
+static void *ext_work(void *arg) {
+    ext_t *ext = arg;
+    ent_t *ent = malloc(sizeof(ent_t));
+    unsigned char *out = malloc(OUT);
+    z_stream strm = {0};
+    if (ent == NULL || out == NULL || inflateInit2(&strm, -15) != Z_OK) {
+        free(out);
+        free(ent);
+        ext_report(ext, "", UNZIP_ABORT);
+        return NULL;
+    }
+    size_t i;
+    while ((i = atomic_fetch_add(&ext->next, 1)) < ext->num) {
+        ext_central(ext->cent[i], ent);
+        if (ent->nlen && ent->name[ent->nlen - 1] == '/')
+            continue;                   // directories already made
+        int status;
+        if (!ext_safe(ent->name))
+            status = UNZIP_NAME;
+        else if ((ent->flags & 1) || (ent->method != 0 && ent->method != 8))
+            status = UNZIP_METHOD;
+        else {
+            int fd = openat(ext->dir, ent->name,
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (fd == -1)
+                status = UNZIP_WRITE;
+            else {
+                status = ext_data(ext, ent, fd, &strm, out);
+
+                // Set the metadata on the open file, and close it.
+                struct timespec times[2] = {
+                    {ent->mtime, 0}, {ent->mtime, 0}
+                };
+                if ((ent->mode && fchmod(fd, ent->mode & 0777)) ||
+                    futimens(fd, times) || close(fd))
+                    if (status == UNZIP_OK)
+                        status = UNZIP_WRITE;
+
+                // Don't leave a partial or invalid file behind.
+                if (status != UNZIP_OK)
+                    unlinkat(ext->dir, ent->name, 0);
+            }
+        }
+        ext_report(ext, ent->name, status);
+    }
+    inflateEnd(&strm);
+    free(out);
+    free(ent);
+    return NULL;
+}
+
+// Make the directories in the path name of length len under dir, including
+// the last component if it ends with a slash. last is the directory path made
+// for the previous call, of length *had, which is updated. Return true if
+// any could not be made.
+static int ext_mkdir(int dir, char *name, size_t len, char *last,
+                     size_t *had) {
+    while (len && name[len - 1] != '/')
+        len--;
+    if (len == 0 || (len == *had && memcmp(name, last, len) == 0))
+        return 0;
+    int bad = 0;
+    for (size_t i = 0; i < len; i++)
+        if (name[i] == '/') {
+            name[i] = 0;
+            if (mkdirat(dir, name, 0777) && errno != EEXIST)
+                bad = 1;
+            name[i] = '/';
+        }
+    memcpy(last, name, len);
+    *had = len;
+    return bad;
+}
+
+// Compare the names of two central directory headers, and then their
+// positions, for qsort().
+static int ext_cmp(void const *a, void const *b) {
+    unsigned char const *p = *(unsigned char const * const *)a,
+                        *q = *(unsigned char const * const *)b;
+    size_t m = GET2(p + 28), n = GET2(q + 28);
+    int cmp = memcmp(p + 46, q + 46, m < n ? m : n);
+    return cmp ? cmp : m != n ? (m < n ? -1 : 1) :
+                       p != q ? (p < q ? -1 : 1) : 0;
+}
+
+// Sort the index of central directory headers by name, and remove all but the
+// last entry for each name, reporting the others as UNZIP_SAME. Otherwise two
+// threads could write the same file at the same time. The sort also puts each
+// directory before its contents.
+static void ext_dedup(ext_t *ext, ent_t *ent) {
+    qsort(ext->cent, ext->num, sizeof(unsigned char *), ext_cmp);
+    size_t keep = 0;
+    for (size_t i = 0; i < ext->num; i++) {
+        unsigned char const *p = ext->cent[i];
+        if (i + 1 < ext->num) {
+            unsigned char const *q = ext->cent[i + 1];
+            size_t n = GET2(p + 28);
+            if (GET2(q + 28) == n && memcmp(p + 46, q + 46, n) == 0) {
+                ext_central(p, ent);
+                ext_report(ext, ent->name, UNZIP_SAME);
+                continue;
+            }
+        }
+        ext->cent[keep++] = p;
+    }
+    ext->num = keep;
+}
+
+// Find the central directory, and index its headers in ext. Return the status.
+static int ext_index(ext_t *ext) {
+    // Find the end record, searching back over a possible comment.
+    unsigned char const *map = ext->map;
+    size_t size = ext->size, end = size < 22 ? 0 : size - 22 + 1;
+    size_t stop = size < 22 + MAX16 ? 0 : size - 22 - MAX16;
+    do {
+        if (end-- == stop)
+            return UNZIP_FORMAT;
+    } while (GET4(map + end) != 0x06054b50 ||
+             end + 22 + GET2(map + end + 20) != size);
+    uint64_t num = GET2(map + end + 10);
+    uint64_t len = GET4(map + end + 12);
+    uint64_t beg = GET4(map + end + 16);
+    size_t rec = end;
+
+    // Use the zip64 end record, if there is one.
+    // The zip64 end record is taken to be the fixed-size one just before the
+    // locator, as written by zipflow, rather than at the offset in the
+    // locator, which would need to be adjusted for anything before the zip.
+    if (end >= 20 && GET4(map + end - 20) == 0x07064b50) {
+        if (end < 76 || GET4(map + end - 76) != 0x06064b50)
+            return UNZIP_FORMAT;
+        rec = end - 76;
+        num = GET8(map + rec + 32);
+        len = GET8(map + rec + 40);
+        beg = GET8(map + rec + 48);
+    }
+
+    // Find the start of the zip file from where the central directory is,
+    // in case there is something before it.
+    if (len > rec || beg > rec - len)
+        return UNZIP_FORMAT;
+    ext->base = rec - len - beg;
+
+    // Index the central directory headers.
+    if (num > SIZE_MAX / sizeof(unsigned char *) || num > len / 46)
+        return UNZIP_FORMAT;
+    ext->cent = malloc((num ? num : 1) * sizeof(unsigned char *));
+    if (ext->cent == NULL)
+        return UNZIP_ABORT;
+    unsigned char const *p = map + ext->base + beg, *last = p + len;
+    for (size_t i = 0; i < num; i++) {
+        if (last - p < 46 || GET4(p) != 0x02014b50)
+            return UNZIP_FORMAT;
+        size_t n = 46 + GET2(p + 28) + GET2(p + 30) + GET2(p + 32);
+        if ((size_t)(last - p) < n)
+            return UNZIP_FORMAT;
+        ext->cent[i] = p;
+        p += n;
+    }
+    ext->num = num;
+    return UNZIP_OK;
+}
+
+// See comments in unzipflow.h.
+int unzip_extract(char const *path, char const *dir, int threads,
+                  void *hook, void (*diag)(void *hook, char const *name,
+                                           int status)) {
+    if (path == NULL || dir == NULL || threads < 0)
+        return -1;
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores < 1 ? 1 : cores > 256 ? 256 : (int)cores;
+    }
+
+    // Map the zip file into memory.
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return UNZIP_READ;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0 ||
+        (uintmax_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return UNZIP_READ;
+    }
+    ext_t ext;
+    ext.size = (size_t)st.st_size;
+    void *map = mmap(NULL, ext.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return UNZIP_READ;
+    ext.map = map;
+    ext.cent = NULL;
+    ext.num = 0;
+    atomic_init(&ext.next, 0);
+    ext.hook = hook;
+    ext.diag = diag;
+    ext.status = UNZIP_OK;
+    pthread_mutex_init(&ext.lock, NULL);
+
+    // Index the central directory, and make the directories, here in one
+    // thread, so that the workers only create files.
+    int ret = ext_index(&ext);
+    ext.dir = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ret == UNZIP_OK && ext.dir == -1)
+        ret = UNZIP_WRITE;
+    ent_t *ent = ret == UNZIP_OK ? malloc(sizeof(ent_t)) : NULL;
+    char *last = ent == NULL ? NULL : malloc(65536);
+    if (ret == UNZIP_OK && last == NULL)
+        ret = UNZIP_ABORT;
+    if (ret == UNZIP_OK) {
+        ext_dedup(&ext, ent);
+        size_t had = 0;
+        for (size_t i = 0; i < ext.num; i++) {
+            ext_central(ext.cent[i], ent);
+            if (!ext_safe(ent->name)) {
+                // Files with unsafe names are reported by the workers.
+                if (ent->nlen && ent->name[ent->nlen - 1] == '/')
+                    ext_report(&ext, ent->name, UNZIP_NAME);
+            }
+            else if (ext_mkdir(ext.dir, ent->name, ent->nlen, last, &had))
+                ext_report(&ext, ent->name, UNZIP_WRITE);
+        }
+
+        // Extract the files on the threads.
+        pthread_t *pool = malloc(threads * sizeof(pthread_t));
+        int made = 0;
+        if (pool != NULL)
+            while (made < threads &&
+                   pthread_create(pool + made, NULL, ext_work, &ext) == 0)
+                made++;
+        if (made == 0)
+            ext_work(&ext);
+        while (made)
+            pthread_join(pool[--made], NULL);
+        free(pool);
+
+        // Set the metadata of the directory entries, now that their contents
+        // are complete, deepest first. Unsafe names were reported above.
+        for (size_t i = ext.num; i--;) {
+            ext_central(ext.cent[i], ent);
+            if (ent->nlen == 0 || ent->name[ent->nlen - 1] != '/' ||
+                !ext_safe(ent->name))
+                continue;
+            struct timespec times[2] = {{ent->mtime, 0}, {ent->mtime, 0}};
+            if ((ent->mode &&
+                 fchmodat(ext.dir, ent->name, ent->mode & 0777, 0)) ||
+                utimensat(ext.dir, ent->name, times, 0))
+                ext_report(&ext, ent->name, UNZIP_WRITE);
+            else
+                ext_report(&ext, ent->name, UNZIP_OK);
+        }
+        ret = ext.status;
+    }
+    free(last);
+    free(ent);
+    if (ext.dir != -1)
+        close(ext.dir);
+    free(ext.cent);
+    pthread_mutex_destroy(&ext.lock);
+    munmap(map, ext.size);
+    return ret;
+}
@@ -0,0 +1,58 @@
+/* unzips.c -- streaming unzipper
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+// Read a zip file from stdin as a stream, and test the entries, listing each
+// one with its length and status on stderr. With -p, also write the data of
+// the entries to stdout, like unzip -p. The exit status is 0 if all of the
+// entries were read and verified, or 1 if not.
+
+#include <stdio.h>
+#include <string.h>
+#include "unzipflow.h"
+
+// Change the mode of an open file, like stdin, to binary in Windows.
+#if defined(_WIN32) || defined(__CYGWIN__)
+#  include <fcntl.h>
+#  include <io.h>
+#  define SET_BINARY_MODE(file) setmode(fileno(file), O_BINARY)
+#else
+#  define SET_BINARY_MODE(file)
+#endif
+
+// Deliver the entry data if out is not NULL.
+static int start(void *out, unzip_entry_t const *entry) {
+    (void)entry;
+    return out == NULL;
+}
+
+// Write entry data to out.
+static int data(void *out, void const *ptr, size_t len) {
+    return fwrite(ptr, 1, len, (FILE *)out) < len;
+}
+
+// List the entry and its status.
+static void done(void *out, unzip_entry_t const *entry, int status) {
+    (void)out;
+    fprintf(stderr, "%12llu  %s  %s\n", (unsigned long long)entry->ulen,
+            entry->name, unzip_reason(status));
+}
+
+int main(int argc, char **argv) {
+    FILE *out = NULL;
+    if (argc == 2 && strcmp(argv[1], "-p") == 0)
+        out = stdout;
+    else if (argc != 1) {
+        fputs("usage: unzips [-p] < infile.zip\n", stderr);
+        return 1;
+    }
+    SET_BINARY_MODE(stdin);
+    SET_BINARY_MODE(stdout);
+    UNZIP *unz = unzip_open(stdin);
+    int ret = unzip_run(unz, out, start, data, done);
+    unzip_close(unz);
+    if (ret > UNZIP_METHOD)
+        fputs("unzips: stream could not be completed\n", stderr);
+    return ret != 0;
+}
@@ -0,0 +1,32 @@
+/* unzipx.c -- parallel unzipper
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+// Extract the entries of a zip file into a directory, using threads, and list
+// the entries that could not be extracted and verified on stderr. The exit
+// status is 0 if all of the entries were extracted and verified, or 1 if not.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "unzipflow.h"
+
+// List an entry that had a problem.
+static void diag(void *hook, char const *name, int status) {
+    (void)hook;
+    if (status != UNZIP_OK)
+        fprintf(stderr, "unzipx: %s: %s\n", name, unzip_reason(status));
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fputs("usage: unzipx infile.zip [dir [threads]]\n", stderr);
+        return 1;
+    }
+    int ret = unzip_extract(argv[1], argc > 2 ? argv[2] : ".",
+                            argc > 3 ? atoi(argv[3]) : 0, NULL, diag);
+    if (ret == UNZIP_READ || ret == UNZIP_FORMAT)
+        fprintf(stderr, "unzipx: could not read the central directory of %s\n",
+                argv[1]);
+    return ret != 0;
+}
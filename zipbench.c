@@ -0,0 +1,1252 @@
+/* zipbench.c -- zipflow benchmarks
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+// Measure the speed of zipflow on reproducible synthetic corpora, so that the
+// effect of a change can be seen, and regressions caught. The results are
+// written to stdout as JSON, for comparison between runs. Progress is noted on
+// stderr. This requires POSIX. Compile with:
+//
+//      cc -O2 -o zipbench zipbench.c zipflow.c -lz -lpthread
+//
+// Usage:
+//
+//      zipbench [mode] [options] > results.json
+//
+// where mode is throughput (the default), meta, latency, or streams.
+//
+// Throughput options:
+//      -c list     corpora: text,source,random,zeros,mixed,tiny,huge
+//                  (default is all but huge)
+//      -a list     interfaces: data,entry (default data,entry)
+//      -l list     compression levels, -1..9 (default 1,6,9)
+//      -b list     zip_data() call sizes in bytes (default 1024,65536,1048576)
+//      -s size     corpus size in MiB for text ... mixed (default 64)
+//      -n count    number of files in the tiny corpus (default 1000000)
+//      -H size     size of the huge corpus in MiB (default 10240)
+//      -d dir      directory for the zip_entry() files (default $TMPDIR)
+//      -y list     zip_rsync() bits, 0 for off (default 0)
+//
+// For the data interface, the corpus is generated in memory and fed to
+// zip_data() in pieces of the call size. For the entry interface, the corpus
+// is written to files in a temporary directory, which are zipped with
+// zip_entry(), and then deleted. The output is discarded by a put() function.
+// Only the zipping is timed, not the corpus generation. Each result reports
+// the wall clock MB/s (10^6 bytes per second) and the CPU time per input byte.
+// The rsyncable results also report the number of flushes, so that their cost
+// in speed and compressed size can be compared to the results with -y 0.
+//
+// Metadata options:
+//      -e list     numbers of entries (default 1000000,10000000,100000000)
+//      -p bytes    payload bytes per entry (default 0)
+//      -l level    compression level (default 1, first of list used)
+//
+// The meta mode measures the per-entry costs that dominate archives with many
+// small entries: header list growth, name allocations, local time conversions,
+// and writing the central directory. Each count is run in a child process
+// into a null sink, so that the peak resident memory is for that run alone.
+// Each result reports the entries per second through zip_meta()/zip_data(),
+// the zip_close() wall time, the peak RSS, and the metadata bytes per entry.
+//
+// Latency options:
+//      -r bytes    record size (default 200)
+//      -R rate     records per second, or 0 for no pacing (default 10000)
+//      -N count    number of records (default 100000)
+//      -l level    compression level (default 1, first of list used)
+//
+// The latency mode streams records into a single entry with one zip_data()
+// call per record, as for log streaming, at a fixed open-loop rate. It records
+// a histogram of the latency of each zip_data() call, and of the end-to-end
+// latency from the start of the zip_data() call until all of the record's
+// bytes can be recovered from the output delivered to put(). The latter is
+// measured exactly by inflating the output in the sink as it arrives, which
+// adds the inflate time to the put() time. Records still in the deflate
+// engine when the entry is completed count until zip_data() completes it.
+//
+// Streams options:
+//      -t list     numbers of concurrent streams
+//                  (default 1,2,4,8,16,32,64,128,256,512,1000)
+//      -k sink     null, devnull, or socket (default null)
+//      -B size     MiB of text per stream for zip_data() (default 4)
+//      -f path     zip path with zip_entry() in each stream instead
+//      -l level    compression level (default 1, first of list used)
+//
+// The streams mode runs each stream in its own thread, all in one process,
+// started together. The null sink is a put() function that discards the
+// output, devnull is zip_open() on /dev/null, and socket is a put() that
+// writes to one end of a socketpair(), with a single thread draining all of
+// the other ends using poll(). Each count is run in a child process. Each
+// result reports the aggregate throughput, Jain's fairness index of the
+// per-stream throughputs (1 is perfectly fair), the spread of the stream
+// completion times, the peak RSS increase per stream, and the number of and
+// average time per allocation through zip_memory(), where contention in the
+// allocator would show up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
+#include "zlib.h"
+#include "zipflow.h"
+
+// Room for temporary path names.
+#define PATHMAX 4096
+
+// Exit with an error message.
+static void bail(char const *why, char const *what) {
+    fprintf(stderr, "zipbench: %s%s%s\n", why, what == NULL ? "" : " ",
+            what == NULL ? "" : what);
+    exit(1);
+}
+
+// Allocate or die.
+static void *alloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+        bail("out of memory", NULL);
+    return ptr;
+}
+
+// ------ reproducible pseudo-random numbers ------
+
+// xorshift64* generator. The same seed always produces the same corpus.
+typedef uint64_t rng_t;
+static uint64_t rng_next(rng_t *rng) {
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    return *rng * 0x2545f4914f6cdd1d;
+}
+
+// Return a random number in 0..n-1.
+static unsigned rng_below(rng_t *rng, unsigned n) {
+    return (unsigned)((rng_next(rng) >> 32) * n >> 32);
+}
+
+// ------ corpora ------
+
+// Corpus kinds.
+enum { TEXT, SOURCE, RANDOM, ZEROS, MIXED, TINY, HUGE, KINDS };
+static char const *kind_name[KINDS] = {
+    "text", "source", "random", "zeros", "mixed", "tiny", "huge"
+};
+
+// Words for the text and source corpora. Picking lower indices more often
+// gives a roughly Zipfian distribution.
+static char const *words[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as",
+    "was", "with", "be", "by", "on", "not", "he", "this", "are", "or", "his",
+    "from", "at", "which", "but", "have", "an", "had", "they", "you", "were",
+    "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+    "more", "when", "will", "would", "who", "so", "no", "stream", "archive",
+    "compression", "directory", "entry", "header", "offset", "length",
+    "deflate", "window", "symbol", "literal", "distance", "checksum"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+static char const *word(rng_t *rng) {
+    unsigned n = rng_below(rng, NWORDS);
+    return words[rng_below(rng, n + 1)];
+}
+
+// Append the string str to buf[*at..len-1], truncating if necessary.
+static void add(unsigned char *buf, size_t len, size_t *at, char const *str) {
+    while (*str && *at < len)
+        buf[(*at)++] = *str++;
+}
+
+// Fill buf[0..len-1] with English-like text.
+static void gen_text(rng_t *rng, unsigned char *buf, size_t len) {
+    size_t at = 0, col = 0;
+    while (at < len) {
+        char const *w = word(rng);
+        add(buf, len, &at, w);
+        col += strlen(w) + 1;
+        if (col > 72 || rng_below(rng, 16) == 0) {
+            add(buf, len, &at, rng_below(rng, 8) ? ".\n" : "\n");
+            col = 0;
+        }
+        else
+            add(buf, len, &at, " ");
+    }
+}
+
+// Fill buf[0..len-1] with C-like source code.
+static void gen_source(rng_t *rng, unsigned char *buf, size_t len) {
+    static char const *lines[] = {
+        "    if (%s->%s == NULL)\n        return -1;\n",
+        "    for (size_t %s = 0; %s < len; %s++)\n",
+        "    %s = %s(%s, %s);\n",
+        "static int %s_%s(zip_t *%s, size_t %s) {\n",
+        "}\n\n",
+        "    // Update the %s %s for the %s %s.\n",
+        "    uint64_t %s = %s->%s + %s;\n"
+    };
+    size_t at = 0;
+    while (at < len) {
+        char const *fmt = lines[rng_below(rng, sizeof(lines) /
+                                               sizeof(lines[0]))];
+        char line[256];
+        snprintf(line, sizeof(line), fmt, word(rng), word(rng), word(rng),
+                 word(rng));
+        add(buf, len, &at, line);
+    }
+}
+
+// Fill buf[0..len-1] with incompressible random bytes.
+static void gen_random(rng_t *rng, unsigned char *buf, size_t len) {
+    for (size_t at = 0; at < len; at++)
+        buf[at] = (unsigned char)(rng_next(rng) >> 56);
+}
+
+// Fill buf[0..len-1] with a mix of 64K segments like media files: mostly
+// random (already compressed), some text metadata, and some zero padding.
+static void gen_mixed(rng_t *rng, unsigned char *buf, size_t len) {
+    for (size_t at = 0; at < len; at += 65536) {
+        size_t n = len - at < 65536 ? len - at : 65536;
+        unsigned pick = rng_below(rng, 8);
+        if (pick < 5)
+            gen_random(rng, buf + at, n);
+        else if (pick < 7)
+            gen_text(rng, buf + at, n);
+        else
+            memset(buf + at, 0, n);
+    }
+}
+
+// Fill buf[0..len-1] with the corpus kind. TINY and HUGE are made of text.
+static void gen(int kind, rng_t *rng, unsigned char *buf, size_t len) {
+    switch (kind) {
+    case SOURCE:  gen_source(rng, buf, len);  break;
+    case RANDOM:  gen_random(rng, buf, len);  break;
+    case ZEROS:   memset(buf, 0, len);        break;
+    case MIXED:   gen_mixed(rng, buf, len);   break;
+    default:      gen_text(rng, buf, len);
+    }
+}
+
+// Return the length of tiny file number i, in 0..256. The same lengths are
+// used for both interfaces.
+static size_t tiny_len(size_t i) {
+    rng_t rng = 0x9e3779b97f4a7c15 ^ i;
+    rng_next(&rng);
+    return rng_below(&rng, 257);
+}
+
+// ------ measurement ------
+
+// Return the wall clock time in seconds.
+static double wall(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Return the user plus system CPU time used by this process in seconds.
+static double cpu(void) {
+    struct rusage use;
+    getrusage(RUSAGE_SELF, &use);
+    return use.ru_utime.tv_sec + use.ru_utime.tv_usec * 1e-6 +
+           use.ru_stime.tv_sec + use.ru_stime.tv_usec * 1e-6;
+}
+
+// Null sink for the zip file, which just counts the bytes.
+static int sink(void *handle, void const *ptr, size_t len) {
+    (void)ptr;
+    *(uint64_t *)handle += len;
+    return 0;
+}
+
+// A timing in progress.
+typedef struct {
+    double wall;            // starting wall clock time
+    double cpu;             // starting CPU time
+    uint64_t out;           // bytes written to the sink
+    ZIP *zip;               // zip stream to the sink
+} run_t;
+
+// Start a timing and a zip stream to a null sink, rsyncable if rsync is not
+// zero.
+static void run_start(run_t *run, int level, int rsync) {
+    run->out = 0;
+    run->zip = zip_pipe(&run->out, sink, level);
+    if (run->zip == NULL)
+        bail("invalid level", NULL);
+    if (zip_rsync(run->zip, rsync))
+        bail("invalid rsync bits", NULL);
+    run->wall = wall();
+    run->cpu = cpu();
+}
+
+// Complete the zip stream and the timing, and write the result as a JSON
+// object. first is true for the first result, to get the commas right.
+static void run_done(run_t *run, int *first, char const *corpus,
+                     char const *api, size_t call, int level, int rsync,
+                     uint64_t bytes, uint64_t entries) {
+    zip_stats_t stats;
+    zip_stats(run->zip, &stats);
+    zip_close(run->zip);
+    double secs = wall() - run->wall;
+    double used = cpu() - run->cpu;
+    printf("%s\n    {\"corpus\": \"%s\", \"api\": \"%s\", \"call\": %zu, "
+           "\"level\": %d, \"rsync\": %d, \"syncs\": %llu, "
+           "\"entries\": %llu, \"bytes\": %llu, "
+           "\"out\": %llu, \"wall_s\": %.6f, \"cpu_s\": %.6f, "
+           "\"mb_s\": %.3f, \"cpu_ns_per_byte\": %.3f}",
+           *first ? "" : ",", corpus, api, call, level, rsync,
+           (unsigned long long)stats.syncs,
+           (unsigned long long)entries, (unsigned long long)bytes,
+           (unsigned long long)run->out, secs, used,
+           secs > 0 ? bytes / secs * 1e-6 : 0.,
+           bytes ? used * 1e9 / bytes : 0.);
+    fflush(stdout);
+    *first = 0;
+    fprintf(stderr, "%s %s call %zu level %d rsync %d: %.1f MB/s\n",
+            corpus, api, call, level, rsync,
+            secs > 0 ? bytes / secs * 1e-6 : 0.);
+}
+
+// ------ throughput ------
+
+// Benchmark parameters.
+typedef struct {
+    int kinds[KINDS];       // true for the corpora to run
+    int data, entry;        // true for the interfaces to run
+    int levels[11];         // compression levels
+    int nlevels;            // number of levels
+    int rsyncs[8];          // zip_rsync() bits, 0 for off
+    int nrsyncs;            // number of rsync bits
+    size_t calls[32];       // zip_data() call sizes
+    int ncalls;             // number of call sizes
+    size_t size;            // corpus size in bytes
+    size_t tiny;            // number of tiny files
+    uint64_t huge;          // size of the huge corpus in bytes
+    char const *dir;        // directory for temporary files
+    uint64_t counts[32];    // numbers of entries for meta
+    int ncounts;            // number of entry counts
+    size_t payload;         // payload bytes per entry for meta
+    size_t record;          // record size for latency
+    uint64_t rate;          // records per second for latency
+    uint64_t records;       // number of records for latency
+    int threads[64];        // numbers of concurrent streams
+    int nthreads;           // number of stream counts
+    int sink;               // sink type for streams
+    size_t bytes;           // bytes per stream for streams
+    char const *path;       // path for zip_entry() for streams, or NULL
+} parm_t;
+
+// Feed len bytes at buf to zip_data() in pieces of call bytes, without
+// completing the entry.
+static void feed(ZIP *zip, unsigned char const *buf, size_t len, size_t call) {
+    while (len) {
+        size_t n = len < call ? len : call;
+        if (zip_data(zip, buf, n, 0))
+            bail("write error", NULL);
+        buf += n;
+        len -= n;
+    }
+}
+
+// Run the zip_data() benchmarks on the corpus kind. buf holds size bytes of
+// the corpus, or of text for TINY and HUGE.
+static void bench_data(parm_t const *parm, int kind, unsigned char const *buf,
+                       size_t size, int *first) {
+    for (int r = 0; r < parm->nlevels * parm->nrsyncs; r++)
+        for (int c = 0; c < parm->ncalls; c++) {
+            int level = parm->levels[r / parm->nrsyncs];
+            int rsync = parm->rsyncs[r % parm->nrsyncs];
+            size_t call = parm->calls[c];
+            run_t run;
+            uint64_t bytes = 0, entries = 0;
+            run_start(&run, level, rsync);
+            if (kind == TINY) {
+                size_t at = 0;
+                for (size_t i = 0; i < parm->tiny; i++) {
+                    char name[48];
+                    snprintf(name, sizeof(name), "d%zu/f%zu", i / 1000, i);
+                    size_t len = tiny_len(i);
+                    if (at + len > size)
+                        at = 0;
+                    zip_meta(run.zip, name, 3, 0644, 1700000000, 1700000000);
+                    feed(run.zip, buf + at, len, call);
+                    zip_data(run.zip, NULL, 0, 1);
+                    at += len;
+                    bytes += len;
+                }
+                entries = parm->tiny;
+            }
+            else {
+                uint64_t want = kind == HUGE ? parm->huge : size;
+                zip_meta(run.zip, kind_name[kind], 3, 0644,
+                         1700000000, 1700000000);
+                while (bytes < want) {
+                    size_t len = want - bytes < size ? want - bytes : size;
+                    feed(run.zip, buf, len, call);
+                    bytes += len;
+                }
+                zip_data(run.zip, NULL, 0, 1);
+                entries = 1;
+            }
+            run_done(&run, first, kind_name[kind], "data", call, level,
+                     rsync, bytes, entries);
+        }
+}
+
+// Write len bytes at buf to the file path, appending if app is true.
+static void put_file(char const *path, unsigned char const *buf, size_t len,
+                     int app) {
+    FILE *out = fopen(path, app ? "ab" : "wb");
+    if (out == NULL || fwrite(buf, 1, len, out) != len || fclose(out))
+        bail("could not write", path);
+}
+
+// Create the files for the entry benchmark of corpus kind in the directory
+// top, returning the number of bytes written. Return the number of files in
+// *files.
+static uint64_t make_files(parm_t const *parm, int kind, char const *top,
+                           unsigned char const *buf, size_t size,
+                           uint64_t *files) {
+    char path[PATHMAX + 64];
+    uint64_t bytes = 0;
+    if (kind == TINY) {
+        size_t at = 0;
+        for (size_t i = 0; i < parm->tiny; i++) {
+            if (i % 1000 == 0) {
+                snprintf(path, sizeof(path), "%s/d%zu", top, i / 1000);
+                if (mkdir(path, 0700))
+                    bail("could not create", path);
+            }
+            snprintf(path, sizeof(path), "%s/d%zu/f%zu", top, i / 1000, i);
+            size_t len = tiny_len(i);
+            if (at + len > size)
+                at = 0;
+            put_file(path, buf + at, len, 0);
+            at += len;
+            bytes += len;
+        }
+        *files = parm->tiny;
+    }
+    else {
+        uint64_t want = kind == HUGE ? parm->huge : size;
+        snprintf(path, sizeof(path), "%s/%s", top, kind_name[kind]);
+        put_file(path, buf, 0, 0);
+        while (bytes < want) {
+            size_t len = want - bytes < size ? want - bytes : size;
+            put_file(path, buf, len, 1);
+            bytes += len;
+        }
+        *files = 1;
+    }
+    return bytes;
+}
+
+// Delete the files made by make_files().
+static void remove_files(parm_t const *parm, int kind, char const *top) {
+    char path[PATHMAX + 64];
+    if (kind == TINY) {
+        for (size_t i = 0; i < parm->tiny; i++) {
+            snprintf(path, sizeof(path), "%s/d%zu/f%zu", top, i / 1000, i);
+            remove(path);
+            if (i % 1000 == 999 || i == parm->tiny - 1) {
+                snprintf(path, sizeof(path), "%s/d%zu", top, i / 1000);
+                rmdir(path);
+            }
+        }
+    }
+    else {
+        snprintf(path, sizeof(path), "%s/%s", top, kind_name[kind]);
+        remove(path);
+    }
+}
+
+// Run the zip_entry() benchmarks on the corpus kind.
+static void bench_entry(parm_t const *parm, int kind, unsigned char const *buf,
+                        size_t size, int *first) {
+    char top[PATHMAX];
+    snprintf(top, sizeof(top), "%s/zipbench.XXXXXX", parm->dir);
+    if (mkdtemp(top) == NULL)
+        bail("could not create a directory in", parm->dir);
+    fprintf(stderr, "writing %s files to %s\n", kind_name[kind], top);
+    uint64_t files;
+    uint64_t bytes = make_files(parm, kind, top, buf, size, &files);
+    for (int r = 0; r < parm->nlevels * parm->nrsyncs; r++) {
+        int level = parm->levels[r / parm->nrsyncs];
+        int rsync = parm->rsyncs[r % parm->nrsyncs];
+        run_t run;
+        run_start(&run, level, rsync);
+        if (zip_entry(run.zip, top))
+            bail("write error", NULL);
+        run_done(&run, first, kind_name[kind], "entry", 0, level, rsync,
+                 bytes, files);
+    }
+    remove_files(parm, kind, top);
+    rmdir(top);
+}
+
+// Run the throughput benchmarks.
+static void throughput(parm_t const *parm) {
+    unsigned char *buf = alloc(parm->size);
+    printf("{\"bench\": \"throughput\", \"zlib\": \"%s\", \"results\": [",
+           zlibVersion());
+    int first = 1;
+    for (int kind = 0; kind < KINDS; kind++) {
+        if (!parm->kinds[kind])
+            continue;
+        rng_t rng = 0x5eed0000 + kind;
+        gen(kind, &rng, buf, parm->size);
+        if (parm->data)
+            bench_data(parm, kind, buf, parm->size, &first);
+        if (parm->entry)
+            bench_entry(parm, kind, buf, parm->size, &first);
+    }
+    puts("\n]}");
+    free(buf);
+}
+
+// ------ metadata scale ------
+
+// Return the peak resident memory of this process in KiB.
+static long long peak_rss(void) {
+    struct rusage use;
+    getrusage(RUSAGE_SELF, &use);
+#ifdef __APPLE__
+    return use.ru_maxrss >> 10;         // bytes on macOS
+#else
+    return use.ru_maxrss;
+#endif
+}
+
+// Write count entries each with the payload bytes at buf to a null sink, and
+// write the result as a JSON object. This is run in a child process, so that
+// the peak RSS is for this run alone.
+static void meta_run(parm_t const *parm, uint64_t count,
+                     unsigned char const *buf, int first) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+        bail("could not fork", NULL);
+    if (pid) {
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status))
+            bail("meta benchmark failed", NULL);
+        return;
+    }
+
+    // Child: add the entries, then close.
+    uint64_t out = 0;
+    ZIP *zip = zip_pipe(&out, sink, parm->levels[0]);
+    double start = wall(), used = cpu();
+    for (uint64_t i = 0; i < count; i++) {
+        char name[48];
+        snprintf(name, sizeof(name), "d%llu/f%llu",
+                 (unsigned long long)(i / 1000), (unsigned long long)i);
+        zip_meta(zip, name, 3, 0644, 1700000000, 1700000000);
+        if (zip_data(zip, buf, parm->payload, 1))
+            bail("write error", NULL);
+    }
+    double adding = wall() - start;
+    zip_stats_t stats;
+    zip_stats(zip, &stats);
+    uint64_t body = out;
+    double mid = wall();
+    zip_close(zip);
+    double closing = wall() - mid;
+    used = cpu() - used;
+    long long rss = peak_rss();
+    printf("%s\n    {\"entries\": %llu, \"payload\": %zu, \"level\": %d, "
+           "\"out\": %llu, \"dir_bytes\": %llu, \"add_s\": %.6f, "
+           "\"entries_per_s\": %.1f, \"close_s\": %.6f, \"cpu_s\": %.6f, "
+           "\"peak_rss_kib\": %lld, \"meta_bytes\": %llu, "
+           "\"meta_per_entry\": %.2f, \"rss_per_entry\": %.2f}",
+           first ? "" : ",", (unsigned long long)count, parm->payload,
+           parm->levels[0], (unsigned long long)out,
+           (unsigned long long)(out - body), adding,
+           adding > 0 ? count / adding : 0., closing, used, rss,
+           (unsigned long long)stats.peak,
+           count ? (double)stats.peak / count : 0.,
+           count ? rss * 1024. / count : 0.);
+    fflush(stdout);
+    fprintf(stderr, "%llu entries: %.0f entries/s, close %.3f s, "
+            "peak RSS %lld KiB\n", (unsigned long long)count,
+            adding > 0 ? count / adding : 0., closing, rss);
+    exit(0);
+}
+
+// Run the metadata scale benchmarks.
+static void meta(parm_t const *parm) {
+    unsigned char *buf = alloc(parm->payload + 1);
+    rng_t rng = 0x5eed0000;
+    gen_text(&rng, buf, parm->payload);
+    printf("{\"bench\": \"meta\", \"zlib\": \"%s\", \"results\": [",
+           zlibVersion());
+    for (int i = 0; i < parm->ncounts; i++)
+        meta_run(parm, parm->counts[i], buf, i == 0);
+    puts("\n]}");
+    free(buf);
+}
+
+// ------ latency ------
+
+// Latency histogram. Values under 8 ns have their own buckets. Above that,
+// each power of two is divided into eight buckets, for 12.5% resolution.
+#define BUCKETS 496
+typedef struct {
+    uint64_t count[BUCKETS];    // number of values in each bucket
+    uint64_t num;               // total number of values
+    uint64_t max;               // largest value
+    double sum;                 // sum of the values
+} hist_t;
+
+// Return the bucket index for ns.
+static int bucket(uint64_t ns) {
+    if (ns < 8)
+        return (int)ns;
+    int e = 3;
+    while (ns >> (e + 1))
+        e++;
+    return (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+}
+
+// Return the smallest value in bucket i.
+static uint64_t bucket_low(int i) {
+    if (i < 8)
+        return i;
+    return (uint64_t)(8 + i % 8) << (i / 8 - 1);
+}
+
+// Add ns to the histogram.
+static void hist_add(hist_t *hist, uint64_t ns) {
+    hist->count[bucket(ns)]++;
+    hist->num++;
+    hist->sum += ns;
+    if (hist->max < ns)
+        hist->max = ns;
+}
+
+// Return the value at fraction p of the histogram, as the largest value in the
+// bucket it lands in, or the maximum value if smaller.
+static uint64_t hist_at(hist_t const *hist, double p) {
+    uint64_t want = (uint64_t)(p * hist->num), seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += hist->count[i];
+        if (seen > want) {
+            uint64_t high = i + 1 < BUCKETS ? bucket_low(i + 1) - 1 :
+                                              hist->max;
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Write the histogram as a JSON object with the summary statistics in ns, and
+// the non-empty buckets as [lowest value, count] pairs.
+static void hist_json(hist_t const *hist, char const *name) {
+    printf("\"%s\": {\"count\": %llu, \"mean_ns\": %.1f, \"p50_ns\": %llu, "
+           "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+           "\"max_ns\": %llu, \"buckets\": [",
+           name, (unsigned long long)hist->num,
+           hist->num ? hist->sum / hist->num : 0.,
+           (unsigned long long)hist_at(hist, .5),
+           (unsigned long long)hist_at(hist, .9),
+           (unsigned long long)hist_at(hist, .99),
+           (unsigned long long)hist_at(hist, .999),
+           (unsigned long long)hist->max);
+    int first = 1;
+    for (int i = 0; i < BUCKETS; i++)
+        if (hist->count[i]) {
+            printf("%s[%llu, %llu]", first ? "" : ", ",
+                   (unsigned long long)bucket_low(i),
+                   (unsigned long long)hist->count[i]);
+            first = 0;
+        }
+    printf("]}");
+}
+
+// Return the monotonic clock in nanoseconds.
+static uint64_t nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Timestamping sink state. The zip output is inflated as it arrives, to find
+// when each record can be recovered from the output.
+typedef struct {
+    uint64_t out;           // bytes written to the sink
+    size_t skip;            // local header bytes left to skip
+    int end;                // true if the deflate stream has ended
+    z_stream strm;          // inflate engine
+    unsigned char buf[65536];   // inflate output (discarded)
+    uint64_t got;           // bytes recovered by inflate so far
+    size_t size;            // record size
+    uint64_t *start;        // start time of each record's zip_data() call
+    uint64_t sent;          // number of records submitted
+    uint64_t done;          // number of records recovered
+    hist_t e2e;             // end-to-end latencies
+} lat_t;
+
+// Timestamping sink. Inflate the entry's compressed data, and note the
+// end-to-end latency of each record that is now completely recovered.
+static int lat_sink(void *handle, void const *ptr, size_t len) {
+    lat_t *lat = handle;
+    if (ptr == NULL)
+        return 0;
+    lat->out += len;
+    if (lat->skip) {
+        size_t n = len < lat->skip ? len : lat->skip;
+        lat->skip -= n;
+        ptr = (unsigned char const *)ptr + n;
+        len -= n;
+    }
+    if (lat->end || len == 0)
+        return 0;
+    lat->strm.next_in = (unsigned char *)(uintptr_t)ptr;
+    lat->strm.avail_in = (unsigned)len;
+    int ret;
+    do {
+        lat->strm.next_out = lat->buf;
+        lat->strm.avail_out = sizeof(lat->buf);
+        ret = inflate(&lat->strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            bail("inflate error on the zip output", NULL);
+        lat->got += sizeof(lat->buf) - lat->strm.avail_out;
+    } while (lat->strm.avail_out == 0);
+    lat->end = ret == Z_STREAM_END;
+    uint64_t now = nanos();
+    while (lat->done < lat->sent && (lat->done + 1) * lat->size <= lat->got)
+        hist_add(&lat->e2e, now - lat->start[lat->done++]);
+    return 0;
+}
+
+// Run the latency benchmark.
+static void latency(parm_t const *parm) {
+    lat_t *lat = alloc(sizeof(lat_t));
+    memset(lat, 0, sizeof(lat_t));
+    lat->size = parm->record;
+    lat->start = alloc((parm->records + 1) * sizeof(uint64_t));
+    if (inflateInit2(&lat->strm, -15) != Z_OK)
+        bail("out of memory", NULL);
+    char const *name = "log";
+    lat->skip = 30 + strlen(name);
+    hist_t *call = alloc(sizeof(hist_t));
+    memset(call, 0, sizeof(hist_t));
+
+    // Make a buffer of text to cycle through for the records.
+    size_t size = 1 << 20;
+    if (size < parm->record)
+        size = parm->record;
+    unsigned char *buf = alloc(size);
+    rng_t rng = 0x5eed0000;
+    gen_text(&rng, buf, size);
+
+    ZIP *zip = zip_pipe(lat, lat_sink, parm->levels[0]);
+    zip_meta(zip, name, 3, 0644, 1700000000, 1700000000);
+    uint64_t begin = nanos();
+    size_t at = 0;
+    for (uint64_t i = 0; i < parm->records; i++) {
+        if (parm->rate) {
+            // Wait until the scheduled time for this record, if not late.
+            uint64_t when = begin + i * 1000000000 / parm->rate;
+            struct timespec ts;
+            ts.tv_sec = when / 1000000000;
+            ts.tv_nsec = when % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                   NULL) == EINTR)
+                ;
+        }
+        if (at + parm->record > size)
+            at = 0;
+        uint64_t start = nanos();
+        lat->start[i] = start;
+        lat->sent = i + 1;
+        if (zip_data(zip, buf + at, parm->record, 0))
+            bail("write error", NULL);
+        hist_add(call, nanos() - start);
+        at += parm->record;
+    }
+    lat->start[parm->records] = nanos();
+    zip_data(zip, NULL, 0, 1);
+    double secs = (nanos() - begin) * 1e-9;
+    zip_close(zip);
+    if (lat->done != parm->records)
+        bail("not all records recovered from the output", NULL);
+
+    printf("{\"bench\": \"latency\", \"zlib\": \"%s\", \"record\": %zu, "
+           "\"rate\": %llu, \"records\": %llu, \"level\": %d, "
+           "\"out\": %llu, \"wall_s\": %.6f,\n ",
+           zlibVersion(), parm->record, (unsigned long long)parm->rate,
+           (unsigned long long)parm->records, parm->levels[0],
+           (unsigned long long)lat->out, secs);
+    hist_json(call, "call");
+    printf(",\n ");
+    hist_json(&lat->e2e, "end_to_end");
+    puts("}");
+    fprintf(stderr, "zip_data() p99 %llu ns, end-to-end p99 %llu ns\n",
+            (unsigned long long)hist_at(call, .99),
+            (unsigned long long)hist_at(&lat->e2e, .99));
+    inflateEnd(&lat->strm);
+    free(buf);
+    free(call);
+    free(lat->start);
+    free(lat);
+}
+
+// ------ concurrent streams ------
+
+// Sink types.
+enum { NULLSINK, DEVNULL, SOCKET, SINKS };
+static char const *sink_name[SINKS] = {"null", "devnull", "socket"};
+
+// Allocation counts and times for each thread, using zip_memory().
+static _Thread_local uint64_t alloc_calls, alloc_ns;
+static void *timed_alloc(void *opaque, size_t size) {
+    (void)opaque;
+    uint64_t start = nanos();
+    void *ptr = malloc(size);
+    alloc_ns += nanos() - start;
+    alloc_calls++;
+    return ptr;
+}
+static void timed_free(void *opaque, void *ptr, size_t size) {
+    (void)opaque;
+    (void)size;
+    uint64_t start = nanos();
+    free(ptr);
+    alloc_ns += nanos() - start;
+    alloc_calls++;
+}
+
+// State for one stream.
+typedef struct {
+    parm_t const *parm;         // benchmark parameters
+    unsigned char const *buf;   // text to zip with zip_data()
+    pthread_barrier_t *go;      // start all streams together
+    int fd;                     // socket to write, for SOCKET
+    uint64_t out;               // bytes written
+    uint64_t bytes;             // uncompressed bytes
+    uint64_t start, end;        // start and end times
+    uint64_t calls, ns;         // allocation calls and time
+} stream_t;
+
+// put() function writing to a socket.
+static int sock_put(void *handle, void const *ptr, size_t len) {
+    stream_t *stream = handle;
+    if (ptr == NULL)
+        return 0;
+    stream->out += len;
+    while (len) {
+        ssize_t got = write(stream->fd, ptr, len);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        ptr = (unsigned char const *)ptr + got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Run one stream.
+static void *stream_run(void *arg) {
+    stream_t *stream = arg;
+    parm_t const *parm = stream->parm;
+    FILE *devnull = NULL;
+    pthread_barrier_wait(stream->go);
+    stream->start = nanos();
+    ZIP *zip;
+    if (parm->sink == DEVNULL) {
+        devnull = fopen("/dev/null", "wb");
+        if (devnull == NULL)
+            bail("could not open /dev/null", NULL);
+        zip = zip_open(devnull, parm->levels[0]);
+    }
+    else if (parm->sink == SOCKET)
+        zip = zip_pipe(stream, sock_put, parm->levels[0]);
+    else
+        zip = zip_pipe(&stream->out, sink, parm->levels[0]);
+    if (parm->path != NULL)
+        zip_entry(zip, parm->path);
+    else {
+        zip_meta(zip, "text", 3, 0644, 1700000000, 1700000000);
+        feed(zip, stream->buf, parm->bytes, 65536);
+        zip_data(zip, NULL, 0, 1);
+    }
+    zip_stats_t stats;
+    zip_stats(zip, &stats);
+    stream->bytes = stats.ulen;
+    if (parm->sink == DEVNULL)
+        stream->out = stats.out;
+    zip_close(zip);
+    if (devnull != NULL)
+        fclose(devnull);
+    if (parm->sink == SOCKET)
+        close(stream->fd);
+    stream->end = nanos();
+    stream->calls = alloc_calls;
+    stream->ns = alloc_ns;
+    return NULL;
+}
+
+// Drain and discard the data from the sockets in the pollfd array at arg,
+// terminated by an fd of -1, until they are all closed.
+static void *drain(void *arg) {
+    struct pollfd *fds = arg;
+    nfds_t n = 0;
+    while (fds[n].fd != -1)
+        n++;
+    nfds_t open = n;
+    static unsigned char buf[65536];
+    while (open) {
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            bail("poll failed", NULL);
+        }
+        for (nfds_t i = 0; i < n; i++)
+            if (fds[i].fd >= 0 && fds[i].revents) {
+                ssize_t got = read(fds[i].fd, buf, sizeof(buf));
+                if (got <= 0 && !(got < 0 && errno == EINTR)) {
+                    close(fds[i].fd);
+                    fds[i].fd = -fds[i].fd - 2;     // poll() ignores < 0
+                    open--;
+                }
+            }
+    }
+    return NULL;
+}
+
+// Run num concurrent streams, and write the result as a JSON object. This is
+// run in a child process.
+static void streams_run(parm_t const *parm, int num,
+                        unsigned char const *buf, int first) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+        bail("could not fork", NULL);
+    if (pid) {
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status))
+            bail("streams benchmark failed", NULL);
+        return;
+    }
+
+    // Child: set up the streams and the sockets.
+    zip_memory(NULL, timed_alloc, timed_free);
+    stream_t *streams = alloc(num * sizeof(stream_t));
+    pthread_t *ids = alloc(num * sizeof(pthread_t));
+    struct pollfd *fds = alloc((num + 1) * sizeof(struct pollfd));
+    pthread_barrier_t go;
+    pthread_barrier_init(&go, NULL, num);
+    for (int i = 0; i < num; i++) {
+        streams[i].parm = parm;
+        streams[i].buf = buf;
+        streams[i].go = &go;
+        streams[i].out = 0;
+        if (parm->sink == SOCKET) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+                bail("could not create socket pair", NULL);
+            streams[i].fd = pair[0];
+            fds[i].fd = pair[1];
+            fds[i].events = POLLIN;
+        }
+    }
+    fds[num].fd = -1;
+    pthread_t drainer;
+    if (parm->sink == SOCKET &&
+        pthread_create(&drainer, NULL, drain, fds))
+        bail("could not create thread", NULL);
+    long long base = peak_rss();
+
+    // Run the streams.
+    for (int i = 0; i < num; i++)
+        if (pthread_create(ids + i, NULL, stream_run, streams + i))
+            bail("could not create thread", NULL);
+    for (int i = 0; i < num; i++)
+        pthread_join(ids[i], NULL);
+    if (parm->sink == SOCKET)
+        pthread_join(drainer, NULL);
+    long long rss = peak_rss() - base;
+
+    // Compute the aggregate throughput, the fairness, and the completion time
+    // spread.
+    uint64_t beg = UINT64_MAX, end = 0, first_end = UINT64_MAX;
+    uint64_t bytes = 0, out = 0, calls = 0, ns = 0;
+    double sum = 0, sum2 = 0;
+    for (int i = 0; i < num; i++) {
+        stream_t const *st = streams + i;
+        if (beg > st->start)
+            beg = st->start;
+        if (end < st->end)
+            end = st->end;
+        if (first_end > st->end)
+            first_end = st->end;
+        bytes += st->bytes;
+        out += st->out;
+        calls += st->calls;
+        ns += st->ns;
+        double rate = st->end > st->start ?
+                      st->bytes / ((st->end - st->start) * 1e-9) : 0.;
+        sum += rate;
+        sum2 += rate * rate;
+    }
+    double secs = (end - beg) * 1e-9;
+    printf("%s\n    {\"streams\": %d, \"sink\": \"%s\", \"api\": \"%s\", "
+           "\"level\": %d, \"bytes\": %llu, \"out\": %llu, "
+           "\"wall_s\": %.6f, \"mb_s\": %.3f, \"fairness\": %.4f, "
+           "\"first_done_s\": %.6f, \"last_done_s\": %.6f, "
+           "\"rss_per_stream_kib\": %.1f, \"allocs\": %llu, "
+           "\"alloc_ns\": %.1f}",
+           first ? "" : ",", num, sink_name[parm->sink],
+           parm->path == NULL ? "data" : "entry", parm->levels[0],
+           (unsigned long long)bytes, (unsigned long long)out, secs,
+           secs > 0 ? bytes / secs * 1e-6 : 0.,
+           sum2 > 0 ? sum * sum / (num * sum2) : 1.,
+           (first_end - beg) * 1e-9, secs, (double)rss / num,
+           (unsigned long long)calls, calls ? (double)ns / calls : 0.);
+    fflush(stdout);
+    fprintf(stderr, "%d streams: %.1f MB/s, fairness %.3f\n", num,
+            secs > 0 ? bytes / secs * 1e-6 : 0.,
+            sum2 > 0 ? sum * sum / (num * sum2) : 1.);
+    exit(0);
+}
+
+// Run the concurrent streams benchmarks.
+static void streams(parm_t const *parm) {
+    unsigned char *buf = alloc(parm->bytes);
+    rng_t rng = 0x5eed0000;
+    gen_text(&rng, buf, parm->bytes);
+    printf("{\"bench\": \"streams\", \"zlib\": \"%s\", \"results\": [",
+           zlibVersion());
+    for (int i = 0; i < parm->nthreads; i++)
+        streams_run(parm, parm->threads[i], buf, i == 0);
+    puts("\n]}");
+    free(buf);
+}
+
+// ------ command line ------
+
+// Parse a comma-separated list of integers at arg into list[0..max-1], and
+// return the count.
+static int parse_list(char const *arg, long long *list, int max) {
+    int n = 0;
+    while (*arg) {
+        char *end;
+        errno = 0;
+        long long val = strtoll(arg, &end, 10);
+        if (end == arg || errno || n == max || (*end && *end != ','))
+            bail("invalid list:", arg);
+        list[n++] = val;
+        arg = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+// Set the true entries in flags[] for the comma-separated names at arg, which
+// must be in names[0..n-1].
+static void parse_names(char *arg, char const **names, int *flags, int n) {
+    for (int i = 0; i < n; i++)
+        flags[i] = 0;
+    for (char *name = strtok(arg, ","); name != NULL;
+         name = strtok(NULL, ",")) {
+        int i = 0;
+        while (i < n && strcmp(name, names[i]))
+            i++;
+        if (i == n)
+            bail("unknown name:", name);
+        flags[i] = 1;
+    }
+}
+
+int main(int argc, char **argv) {
+    parm_t parm;
+    for (int kind = 0; kind < KINDS; kind++)
+        parm.kinds[kind] = kind != HUGE;
+    parm.data = 1;
+    parm.entry = 1;
+    parm.nlevels = 3;
+    parm.levels[0] = 1;
+    parm.levels[1] = 6;
+    parm.levels[2] = 9;
+    parm.nrsyncs = 1;
+    parm.rsyncs[0] = 0;
+    parm.ncalls = 3;
+    parm.calls[0] = 1024;
+    parm.calls[1] = 65536;
+    parm.calls[2] = 1048576;
+    parm.size = 64 << 20;
+    parm.tiny = 1000000;
+    parm.huge = (uint64_t)10240 << 20;
+    parm.dir = getenv("TMPDIR") == NULL ? "/tmp" : getenv("TMPDIR");
+    parm.ncounts = 3;
+    parm.counts[0] = 1000000;
+    parm.counts[1] = 10000000;
+    parm.counts[2] = 100000000;
+    parm.payload = 0;
+    parm.record = 200;
+    parm.rate = 10000;
+    parm.records = 100000;
+    int counts[] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1000};
+    parm.nthreads = sizeof(counts) / sizeof(counts[0]);
+    memcpy(parm.threads, counts, sizeof(counts));
+    parm.sink = NULLSINK;
+    parm.bytes = 4 << 20;
+    parm.path = NULL;
+
+    // Get the mode.
+    char const *modes[] = {"throughput", "meta", "latency", "streams"};
+    int mode = 0;
+    if (argc > 1 && argv[1][0] != '-') {
+        while (mode < 4 && strcmp(argv[1], modes[mode]))
+            mode++;
+        if (mode == 4)
+            bail("unknown mode:", argv[1]);
+        argc--;
+        argv++;
+    }
+
+    int opt;
+    long long list[32];
+    char const *apis[2] = {"data", "entry"};
+    int flags[2];
+    char const *opts = "c:a:l:b:s:n:H:d:y:e:p:r:R:N:t:k:B:f:";
+    while ((opt = getopt(argc, argv, opts)) != -1) {
+        int n;
+        switch (opt) {
+        case 'c':
+            parse_names(optarg, kind_name, parm.kinds, KINDS);
+            break;
+        case 'a':
+            parse_names(optarg, apis, flags, 2);
+            parm.data = flags[0];
+            parm.entry = flags[1];
+            break;
+        case 'l':
+            n = parse_list(optarg, list, 11);
+            for (int i = 0; i < n; i++) {
+                if (list[i] < -1 || list[i] > 9)
+                    bail("invalid level:", optarg);
+                parm.levels[i] = (int)list[i];
+            }
+            parm.nlevels = n;
+            break;
+        case 'b':
+            n = parse_list(optarg, list, 32);
+            for (int i = 0; i < n; i++) {
+                if (list[i] < 1)
+                    bail("invalid call size:", optarg);
+                parm.calls[i] = (size_t)list[i];
+            }
+            parm.ncalls = n;
+            break;
+        case 's':
+        case 'n':
+        case 'H':
+            if (parse_list(optarg, list, 1) != 1 || list[0] < 1)
+                bail("invalid size:", optarg);
+            if (opt == 's')
+                parm.size = (size_t)list[0] << 20;
+            else if (opt == 'n')
+                parm.tiny = (size_t)list[0];
+            else
+                parm.huge = (uint64_t)list[0] << 20;
+            break;
+        case 'd':
+            parm.dir = optarg;
+            break;
+        case 'y':
+            n = parse_list(optarg, list, 8);
+            for (int i = 0; i < n; i++) {
+                if (list[i] != 0 && (list[i] < 8 || list[i] > 24))
+                    bail("invalid rsync bits:", optarg);
+                parm.rsyncs[i] = (int)list[i];
+            }
+            parm.nrsyncs = n;
+            break;
+        case 'e':
+            n = parse_list(optarg, list, 32);
+            for (int i = 0; i < n; i++) {
+                if (list[i] < 0)
+                    bail("invalid count:", optarg);
+                parm.counts[i] = (uint64_t)list[i];
+            }
+            parm.ncounts = n;
+            break;
+        case 'p':
+            if (parse_list(optarg, list, 1) != 1 || list[0] < 0)
+                bail("invalid payload:", optarg);
+            parm.payload = (size_t)list[0];
+            break;
+        case 'r':
+        case 'R':
+        case 'N':
+            if (parse_list(optarg, list, 1) != 1 || list[0] < (opt != 'R'))
+                bail("invalid number:", optarg);
+            if (opt == 'r')
+                parm.record = (size_t)list[0];
+            else if (opt == 'R')
+                parm.rate = (uint64_t)list[0];
+            else
+                parm.records = (uint64_t)list[0];
+            break;
+        case 't':
+            n = parse_list(optarg, list, 64);
+            for (int i = 0; i < n; i++) {
+                if (list[i] < 1 || list[i] > 100000)
+                    bail("invalid number of streams:", optarg);
+                parm.threads[i] = (int)list[i];
+            }
+            parm.nthreads = n;
+            break;
+        case 'k': {
+            int kinds[SINKS];
+            parse_names(optarg, sink_name, kinds, SINKS);
+            parm.sink = kinds[SOCKET] ? SOCKET :
+                        kinds[DEVNULL] ? DEVNULL : NULLSINK;
+            break;
+        }
+        case 'B':
+            if (parse_list(optarg, list, 1) != 1 || list[0] < 1)
+                bail("invalid size:", optarg);
+            parm.bytes = (size_t)list[0] << 20;
+            break;
+        case 'f':
+            parm.path = optarg;
+            break;
+        default:
+            fputs("usage: zipbench [throughput] [-c corpora] [-a data,entry] "
+                  "[-l levels] [-b sizes]\n"
+                  "                [-s MiB] [-n count] [-H MiB] [-d dir] "
+                  "[-y bits]\n"
+                  "       zipbench meta [-e counts] [-p bytes] [-l level]\n"
+                  "       zipbench latency [-r bytes] [-R rate] [-N count] "
+                  "[-l level]\n"
+                  "       zipbench streams [-t counts] [-k sink] [-B MiB] "
+                  "[-f path] [-l level]\n",
+                  stderr);
+            return 1;
+        }
+    }
+    if (mode == 0)
+        throughput(&parm);
+    else if (mode == 1)
+        meta(&parm);
+    else if (mode == 2)
+        latency(&parm);
+    else
+        streams(&parm);
+    return 0;
+}
@@ -12,9 +12,36 @@
 #include <time.h>
 #include <limits.h>
 #include <assert.h>
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#  include <bcrypt.h>
+#  ifdef _MSC_VER
+#    pragma comment(lib, "bcrypt")
+#  endif
+#  include <io.h>
+#  define fseeko _fseeki64
+#  define ftello _ftelli64
+#else
+#  include <unistd.h>
+#endif
+#if defined(__AES__) && (defined(__x86_64__) || defined(__i386__))
+#  include <wmmintrin.h>
+#  define AESNI
+#endif
 #include "zlib.h"
 #include "zipflow.h"
 
+// Static tracepoints for bpftrace, perf, and other tools, if compiled with
+// -DZIPFLOW_SDT, which requires systemtap's sys/sdt.h. The probe points are
+// then a single nop each until a tool attaches. Otherwise they vanish.
+#ifdef ZIPFLOW_SDT
+#  include <sys/sdt.h>
+#  define probe(...) STAP_PROBEV(zipflow, __VA_ARGS__)
+#else
+#  define probe(...)
+#endif
+
 // Maximum two and four-byte field values.
 #define MAX16 0xffff
 #define MAX32 0xffffffff
@@ -26,13 +53,17 @@
 #  define CHUNK 262144
 #endif
 
-// Information on each entry saved for the central directory. This takes up 64
-// to 72 bytes, plus the zero-terminated file name allocation for each entry.
+// Information on each entry saved for the central directory. This takes up 72
+// to 80 bytes, plus the zero-terminated file name allocation for each entry.
 typedef struct {
     char *name;                 // path name (allocated)
     uint16_t nlen;              // path name length
     uint8_t os;                 // operating system (currently 3 or 10)
-    uint8_t spare;              // (structure padding)
+    uint8_t lock;               // true if encrypted with AES
+    uint8_t method;             // compression method (0 stored, 8 deflate)
+    uint8_t desc;               // true if followed by a data descriptor
+    uint16_t flags;             // UTF-8 and deflate level bit flags
+    uint16_t need;              // version needed for an old entry, else 0
     uint64_t ulen;              // uncompressed length
     uint64_t clen;              // compressed length
     uint32_t crc;               // CRC-32 of uncompressed data
@@ -43,6 +74,43 @@ typedef struct {
     uint64_t off;               // offset of local header
 } head_t;
 
+// Memory allocation functions. If alloc is NULL, then malloc() and free() are
+// used.
+typedef struct {
+    void *opaque;               // user opaque pointer for alloc() and free()
+    void *(*alloc)(void *, size_t);         // allocate memory
+    void (*free)(void *, void *, size_t);   // free memory
+} mem_t;
+
+// Process-wide memory allocation functions registered by zip_memory(). Each
+// zip_t saves a copy of these when created, so that its allocations are all
+// freed using the same functions used to allocate them.
+static mem_t zip_mem = {NULL, NULL, NULL};
+
+// SHA-256 or SHA-1 state, for the digests requested by zip_digest(), and for
+// the key derivation and authentication for zip_encrypt().
+typedef struct {
+    void (*block)(uint32_t *, unsigned char const *);   // compress a block
+    unsigned size;              // digest size in bytes (32 or 20)
+    uint32_t h[8];              // hash value
+    uint64_t len;               // total length in bytes
+    unsigned char buf[64];      // partial block
+} sha_t;
+
+// HMAC-SHA1 state, with the inner and outer hashes started with the key.
+typedef struct {
+    sha_t in;                   // inner hash
+    sha_t out;                  // outer hash
+} hmac_t;
+
+// AES-256 expanded encryption key.
+typedef struct {
+    uint32_t rk[60];            // round keys
+#ifdef AESNI
+    __m128i xk[15];             // round keys for AES-NI
+#endif
+} aes_t;
+
 // zip file state. All path names are built up in the single allocation at
 // path, which grows as needed. The list of header information structures at
 // head hold the metadata that will be needed for the central directory, and
@@ -54,11 +122,27 @@ typedef struct {
     unsigned char *data;        // uncompressed deflate input buffer
     unsigned char *comp;        // compressed deflate output buffer
     uint64_t off;               // current offset in zip file
+    int64_t base;               // position of the zip file in out if seeking
+    uint64_t old;               // offset after the entries from zip_append()
+    char seek;                  // true to complete local headers by seeking
     uint32_t id;                // constant identifier for validity check
     char bad;                   // true if there is a write error
     char omit;                  // true to omit entry in central directory
     char feed;                  // true if feeding data with zip_data()
     char level;                 // requested compression level
+    unsigned align;             // alignment of stored entry data, or 0
+    char known;                 // true if zip_known() provided the length
+    char verify;                // true to verify the zip_known() CRC-32
+    uint64_t size;              // uncompressed length from zip_known()
+    uint32_t check;             // CRC-32 of the data to verify
+    char rbits;                 // rsyncable hash bits, or 0 if not
+    uint64_t span;              // input bytes between seek points, or 0
+    uint64_t fed;               // entry input given to zip_sync() so far
+    uint64_t mark;              // entry input offset of the next seek point
+    uint32_t rhash;             // rolling hash of the input for rsyncable
+    char fixed;                 // true for reproducible output
+    char pinned;                // true to set all times to epoch
+    int64_t epoch;              // latest time if fixed, or -1 for none
     size_t plen;                // path name length
     size_t pmax;                // path name allocation in bytes
     char *path;                 // current path (allocated)
@@ -67,17 +151,62 @@ typedef struct {
     head_t *head;               // list of headers (allocated)
     void *hook;                 // user opaque pointer for log() function
     void (*log)(void *, char *);    // log function
+    void *dhook;                // user opaque pointer for diag() function
+    void (*diag)(void *, int, int, char const *);   // diagnostic function
+    void *thook;                // user opaque pointer for track() function
+    void (*track)(void *, char const *, zip_stats_t const *);   // per entry
+    zip_stats_t all;            // statistics up to the current entry
+    zip_stats_t one;            // statistics for the current entry
+    void *phook;                // user opaque pointer for progress() function
+    void (*progress)(void *, char const *, uint64_t, uint64_t);
+    uint64_t pbytes;            // bytes between progress() calls
+    uint64_t pns;               // nanoseconds between progress() calls
+    uint64_t pin;               // input bytes at last progress() call
+    uint64_t ptime;             // clock at last progress() call
+    uint64_t *sizes;            // file bytes and count totals for zip_size()
+    void *ihandle;              // user opaque pointer for index put()
+    int (*iput)(void *, void const *, size_t);  // write index records
+    uint64_t start;             // offset of the current entry's data
+    void *shook;                // user opaque pointer for digest() function
+    void (*digest)(void *, char const *, unsigned char const *);
+    char whole;                 // true if computing the zip file digest
+    char hashed;                // true if computing the entry digest
+    sha_t esha;                 // SHA-256 of the current entry's data
+    sha_t zsha;                 // SHA-256 of the zip file so far
+    char crypt;                 // true to encrypt new entries
+    unsigned char used;         // bytes of pad used
+    uint64_t salts;             // number of salts made from seed
+    unsigned char seed[32];     // random seed for the salts
+    hmac_t pass;                // HMAC-SHA1 keyed with the password
+    hmac_t auth;                // authentication of the current entry
+    aes_t aes;                  // encryption key for the current entry
+    unsigned char ctr[16];      // CTR mode counter
+    unsigned char pad[16];      // CTR mode key stream block
+    mem_t mem;                  // memory allocation functions
     z_stream strm;              // re-useable deflate engine
 } zip_t;
 
 // Constant in zip_t for validity check.
 #define ID 3989422804
 
-// Issue a message. If set, use the registered log() function instead of
-// writing to stderr.
-#define warn(...) \
-    zip_msg(zip, __VA_ARGS__)
-static void zip_msg(zip_t *zip, char const *fmt, ...) {
+// Issue a diagnostic with code and system error number err, regarding
+// zip->path, or the output for ZIP_WRITE. Count it in the statistics. If set,
+// deliver it to the registered diag() function, without formatting a message.
+// Otherwise format the message, and use the registered log() function if set,
+// instead of writing to stderr.
+#define warn(code, err, ...) \
+    zip_msg(zip, code, err, __VA_ARGS__)
+static void zip_msg(zip_t *zip, int code, int err, char const *fmt, ...) {
+    if (zip->sizes != NULL)
+        // Messages will be issued when the files are zipped, not when sizing.
+        return;
+    zip->one.diag[code]++;
+    if (zip->diag != NULL) {
+        zip->diag(zip->dhook, code, err,
+                  code == ZIP_WRITE ? NULL :
+                  code == ZIP_KNOWN ? zip->head[zip->hnum].name : zip->path);
+        return;
+    }
     if (zip->log == NULL) {
         fputs("zipflow: ", stderr);
         va_list args;
@@ -108,16 +237,530 @@ static void zip_msg(zip_t *zip, char const *fmt, ...) {
     }
 }
 
+// Allocate size bytes using the memory allocation functions in mem.
+static void *mem_alloc(mem_t const *mem, size_t size) {
+    void *ptr = mem->alloc == NULL ? malloc(size) :
+                                     mem->alloc(mem->opaque, size);
+    assert(ptr != NULL && "out of memory");
+    return ptr;
+}
+
+// Free the size bytes at ptr, which were allocated by mem_alloc().
+static void mem_free(mem_t const *mem, void *ptr, size_t size) {
+    if (mem->alloc == NULL)
+        free(ptr);
+    else
+        mem->free(mem->opaque, ptr, size);
+}
+
+// Allocate, reallocate, and free memory for zip using the allocation functions
+// it was created with. zip_realloc() resizes the allocation at ptr from old to
+// size bytes.
+#define zip_alloc(zip, size) \
+    mem_alloc(&(zip)->mem, size)
+#define zip_free(zip, ptr, size) \
+    mem_free(&(zip)->mem, ptr, size)
+static void *zip_realloc(zip_t *zip, void *ptr, size_t old, size_t size) {
+    if (zip->mem.alloc == NULL) {
+        ptr = realloc(ptr, size);
+        assert(ptr != NULL && "out of memory");
+        return ptr;
+    }
+    void *mem = zip_alloc(zip, size);
+    memcpy(mem, ptr, old < size ? old : size);
+    zip_free(zip, ptr, old);
+    return mem;
+}
+
+// Allocation functions for zlib when using registered allocation functions.
+// zlib does not provide the size when freeing, so it is saved in front of the
+// allocation, in a header that preserves alignment.
+typedef union {
+    size_t size;
+    long double align1;
+    void *align2;
+    uint64_t align3;
+} zmem_t;
+static void *zip_zalloc(void *opaque, unsigned items, unsigned size) {
+    size_t len = sizeof(zmem_t) + (size_t)items * size;
+    zmem_t *mem = zip_alloc((zip_t *)opaque, len);
+    mem->size = len;
+    return mem + 1;
+}
+static void zip_zfree(void *opaque, void *ptr) {
+    zmem_t *mem = (zmem_t *)ptr - 1;
+    zip_free((zip_t *)opaque, mem, mem->size);
+}
+
+// Return a monotonic clock in nanoseconds, for the statistics. This is sampled
+// per chunk of data, not per byte, so that the statistics can always be kept.
+static uint64_t zip_clock(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq = {0};
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 /
+           freq.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Add the statistics counts and times in add to sum. The metadata memory
+// amounts are not additive, and so are not touched.
+static void stats_add(zip_stats_t *sum, zip_stats_t const *add) {
+    sum->entries += add->entries;
+    sum->ulen += add->ulen;
+    sum->clen += add->clen;
+    sum->out += add->out;
+    sum->opens += add->opens;
+    sum->reads += add->reads;
+    sum->puts += add->puts;
+    sum->syncs += add->syncs;
+    sum->read_ns += add->read_ns;
+    sum->crc_ns += add->crc_ns;
+    sum->hash_ns += add->hash_ns;
+    sum->crypt_ns += add->crypt_ns;
+    sum->deflate_ns += add->deflate_ns;
+    sum->put_ns += add->put_ns;
+    for (int i = 0; i < ZIP_DIAGS; i++)
+        sum->diag[i] += add->diag[i];
+}
+
+// Fold the statistics accumulated in zip->one into zip->all, and start anew
+// for the next entry.
+static void zip_fold(zip_t *zip) {
+    stats_add(&zip->all, &zip->one);
+    memset(&zip->one, 0, sizeof(zip_stats_t));
+}
+
+// Account for add bytes allocated and sub bytes freed for metadata.
+static void zip_held(zip_t *zip, size_t add, size_t sub) {
+    zip->all.meta += add;
+    zip->all.meta -= sub;
+    if (zip->all.peak < zip->all.meta)
+        zip->all.peak = zip->all.meta;
+}
+
+// SHA-256 round constants.
+static uint32_t const sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Rotate the 32-bit x right by n bits.
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Process the 64-byte block at p into the SHA-256 hash value h.
+static void sha_block(uint32_t *h, unsigned char const *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++, p += 4)
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | p[3];
+    for (int i = 16; i < 64; i++)
+        w[i] = w[i - 16] + w[i - 7] +
+               (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3],
+             e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+                     ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+        uint32_t u = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+                     ((a & b) ^ (a & c) ^ (b & c));
+        k = g;  g = f;  f = e;  e = d + t;
+        d = c;  c = b;  b = a;  a = t + u;
+    }
+    h[0] += a;  h[1] += b;  h[2] += c;  h[3] += d;
+    h[4] += e;  h[5] += f;  h[6] += g;  h[7] += k;
+}
+
+// Start a SHA-256 hash.
+static void sha_init(sha_t *sha) {
+    static uint32_t const h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    sha->block = sha_block;
+    sha->size = 32;
+    memcpy(sha->h, h, sizeof(h));
+    sha->len = 0;
+}
+
+// Process the 64-byte block at p into the SHA-1 hash value h.
+static void sha1_block(uint32_t *h, unsigned char const *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++, p += 4)
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | p[3];
+    for (int i = 16; i < 80; i++)
+        w[i] = ROR(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 31);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f = i < 20 ? ((b & c) | (~b & d)) + 0x5a827999 :
+                     i < 40 ? (b ^ c ^ d) + 0x6ed9eba1 :
+                     i < 60 ? ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc :
+                              (b ^ c ^ d) + 0xca62c1d6;
+        uint32_t t = ROR(a, 27) + f + e + w[i];
+        e = d;  d = c;  c = ROR(b, 2);  b = a;  a = t;
+    }
+    h[0] += a;  h[1] += b;  h[2] += c;  h[3] += d;  h[4] += e;
+}
+
+// Start a SHA-1 hash.
+static void sha1_init(sha_t *sha) {
+    static uint32_t const h[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    sha->block = sha1_block;
+    sha->size = 20;
+    memcpy(sha->h, h, sizeof(h));
+    sha->len = 0;
+}
+
+// Add the len bytes at data to the SHA-256 hash.
+static void sha_update(sha_t *sha, void const *data, size_t len) {
+    unsigned char const *next = data;
+    unsigned have = sha->len & 63;
+    sha->len += len;
+    if (have) {
+        unsigned fill = 64 - have;
+        if (len < fill) {
+            memcpy(sha->buf + have, next, len);
+            return;
+        }
+        memcpy(sha->buf + have, next, fill);
+        sha->block(sha->h, sha->buf);
+        next += fill;
+        len -= fill;
+    }
+    while (len >= 64) {
+        sha->block(sha->h, next);
+        next += 64;
+        len -= 64;
+    }
+    memcpy(sha->buf, next, len);
+}
+
+// Complete the hash, putting the sha->size-byte digest in dig.
+static void sha_final(sha_t *sha, unsigned char *dig) {
+    uint64_t bits = sha->len << 3;
+    unsigned have = sha->len & 63;
+    sha->buf[have++] = 0x80;
+    if (have > 56) {
+        memset(sha->buf + have, 0, 64 - have);
+        sha->block(sha->h, sha->buf);
+        have = 0;
+    }
+    memset(sha->buf + have, 0, 56 - have);
+    for (int i = 0; i < 8; i++)
+        sha->buf[56 + i] = bits >> (56 - 8 * i);
+    sha->block(sha->h, sha->buf);
+    for (unsigned i = 0; i < sha->size >> 2; i++) {
+        dig[4 * i] = sha->h[i] >> 24;
+        dig[4 * i + 1] = sha->h[i] >> 16;
+        dig[4 * i + 2] = sha->h[i] >> 8;
+        dig[4 * i + 3] = sha->h[i];
+    }
+}
+
+// Erase the len bytes of secrets at ptr, in a way that won't be optimized
+// away.
+static void zip_wipe(void *ptr, size_t len) {
+    volatile unsigned char *p = ptr;
+    while (len--)
+        *p++ = 0;
+}
+
+// Start an HMAC-SHA1 with the len bytes at key.
+static void hmac_key(hmac_t *mac, unsigned char const *key, size_t len) {
+    unsigned char sum[20], pad[64];
+    if (len > 64) {
+        sha1_init(&mac->in);
+        sha_update(&mac->in, key, len);
+        sha_final(&mac->in, sum);
+        key = sum;
+        len = 20;
+    }
+    for (size_t i = 0; i < 64; i++)
+        pad[i] = (i < len ? key[i] : 0) ^ 0x36;
+    sha1_init(&mac->in);
+    sha_update(&mac->in, pad, 64);
+    for (size_t i = 0; i < 64; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha1_init(&mac->out);
+    sha_update(&mac->out, pad, 64);
+}
+
+// Complete the HMAC-SHA1 whose message was fed to in, a copy of mac->in,
+// putting the 20-byte result in dig.
+static void hmac_done(hmac_t const *mac, sha_t *in, unsigned char *dig) {
+    unsigned char sum[20];
+    sha_final(in, sum);
+    sha_t out = mac->out;
+    sha_update(&out, sum, 20);
+    sha_final(&out, dig);
+}
+
+// Derive len bytes at key from the password in mac and the slen bytes at salt
+// using PBKDF2 with HMAC-SHA1 and 1000 iterations, as WinZip AES requires.
+// The password's HMAC state is started once, and copied for each iteration.
+// Each iteration after the first hashes a 20-byte message, which with the
+// padding and length is a single block for the inner and for the outer hash,
+// so those blocks are built here and compressed directly.
+static void pbkdf2(hmac_t const *mac, unsigned char const *salt, size_t slen,
+                   unsigned char *key, size_t len) {
+    unsigned char blk[64];
+    memset(blk, 0, sizeof(blk));
+    blk[20] = 0x80;                 // padding after the 20-byte message
+    blk[62] = (64 + 20) >> 5;       // (64 + 20) * 8 bits, big-endian
+    blk[63] = ((64 + 20) << 3) & 0xff;
+    for (uint32_t n = 1; len; n++) {
+        unsigned char num[4], t[20];
+        num[0] = n >> 24;  num[1] = n >> 16;  num[2] = n >> 8;  num[3] = n;
+        sha_t in = mac->in;
+        sha_update(&in, salt, slen);
+        sha_update(&in, num, 4);
+        hmac_done(mac, &in, blk);
+        memcpy(t, blk, 20);
+        for (int i = 1; i < 1000; i++) {
+            uint32_t h[5];
+            for (int k = 0; k < 2; k++) {
+                memcpy(h, k ? mac->out.h : mac->in.h, sizeof(h));
+                sha1_block(h, blk);
+                for (int j = 0; j < 5; j++) {
+                    blk[4 * j] = h[j] >> 24;
+                    blk[4 * j + 1] = h[j] >> 16;
+                    blk[4 * j + 2] = h[j] >> 8;
+                    blk[4 * j + 3] = h[j];
+                }
+            }
+            for (int j = 0; j < 20; j++)
+                t[j] ^= blk[j];
+        }
+        size_t got = len < 20 ? len : 20;
+        memcpy(key, t, got);
+        key += got;
+        len -= got;
+    }
+    zip_wipe(blk, sizeof(blk));
+}
+
+// AES S-box, and the round table combining it with MixColumns. The other three
+// round tables are rotations of aes_mix[].
+static unsigned char const aes_s[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b,
+    0xfe, 0xd7, 0xab, 0x76, 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26,
+    0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2,
+    0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed,
+    0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f,
+    0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec,
+    0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14,
+    0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d,
+    0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f,
+    0x4b, 0xbd, 0x8b, 0x8a, 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1, 0xf8, 0x98, 0x11,
+    0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f,
+    0xb0, 0x54, 0xbb, 0x16
+};
+
+#ifndef AESNI
+static uint32_t const aes_mix[256] = {
+    0xc66363a5, 0xf87c7c84, 0xee777799, 0xf67b7b8d, 0xfff2f20d, 0xd66b6bbd,
+    0xde6f6fb1, 0x91c5c554, 0x60303050, 0x02010103, 0xce6767a9, 0x562b2b7d,
+    0xe7fefe19, 0xb5d7d762, 0x4dababe6, 0xec76769a, 0x8fcaca45, 0x1f82829d,
+    0x89c9c940, 0xfa7d7d87, 0xeffafa15, 0xb25959eb, 0x8e4747c9, 0xfbf0f00b,
+    0x41adadec, 0xb3d4d467, 0x5fa2a2fd, 0x45afafea, 0x239c9cbf, 0x53a4a4f7,
+    0xe4727296, 0x9bc0c05b, 0x75b7b7c2, 0xe1fdfd1c, 0x3d9393ae, 0x4c26266a,
+    0x6c36365a, 0x7e3f3f41, 0xf5f7f702, 0x83cccc4f, 0x6834345c, 0x51a5a5f4,
+    0xd1e5e534, 0xf9f1f108, 0xe2717193, 0xabd8d873, 0x62313153, 0x2a15153f,
+    0x0804040c, 0x95c7c752, 0x46232365, 0x9dc3c35e, 0x30181828, 0x379696a1,
+    0x0a05050f, 0x2f9a9ab5, 0x0e070709, 0x24121236, 0x1b80809b, 0xdfe2e23d,
+    0xcdebeb26, 0x4e272769, 0x7fb2b2cd, 0xea75759f, 0x1209091b, 0x1d83839e,
+    0x582c2c74, 0x341a1a2e, 0x361b1b2d, 0xdc6e6eb2, 0xb45a5aee, 0x5ba0a0fb,
+    0xa45252f6, 0x763b3b4d, 0xb7d6d661, 0x7db3b3ce, 0x5229297b, 0xdde3e33e,
+    0x5e2f2f71, 0x13848497, 0xa65353f5, 0xb9d1d168, 0x00000000, 0xc1eded2c,
+    0x40202060, 0xe3fcfc1f, 0x79b1b1c8, 0xb65b5bed, 0xd46a6abe, 0x8dcbcb46,
+    0x67bebed9, 0x7239394b, 0x944a4ade, 0x984c4cd4, 0xb05858e8, 0x85cfcf4a,
+    0xbbd0d06b, 0xc5efef2a, 0x4faaaae5, 0xedfbfb16, 0x864343c5, 0x9a4d4dd7,
+    0x66333355, 0x11858594, 0x8a4545cf, 0xe9f9f910, 0x04020206, 0xfe7f7f81,
+    0xa05050f0, 0x783c3c44, 0x259f9fba, 0x4ba8a8e3, 0xa25151f3, 0x5da3a3fe,
+    0x804040c0, 0x058f8f8a, 0x3f9292ad, 0x219d9dbc, 0x70383848, 0xf1f5f504,
+    0x63bcbcdf, 0x77b6b6c1, 0xafdada75, 0x42212163, 0x20101030, 0xe5ffff1a,
+    0xfdf3f30e, 0xbfd2d26d, 0x81cdcd4c, 0x180c0c14, 0x26131335, 0xc3ecec2f,
+    0xbe5f5fe1, 0x359797a2, 0x884444cc, 0x2e171739, 0x93c4c457, 0x55a7a7f2,
+    0xfc7e7e82, 0x7a3d3d47, 0xc86464ac, 0xba5d5de7, 0x3219192b, 0xe6737395,
+    0xc06060a0, 0x19818198, 0x9e4f4fd1, 0xa3dcdc7f, 0x44222266, 0x542a2a7e,
+    0x3b9090ab, 0x0b888883, 0x8c4646ca, 0xc7eeee29, 0x6bb8b8d3, 0x2814143c,
+    0xa7dede79, 0xbc5e5ee2, 0x160b0b1d, 0xaddbdb76, 0xdbe0e03b, 0x64323256,
+    0x743a3a4e, 0x140a0a1e, 0x924949db, 0x0c06060a, 0x4824246c, 0xb85c5ce4,
+    0x9fc2c25d, 0xbdd3d36e, 0x43acacef, 0xc46262a6, 0x399191a8, 0x319595a4,
+    0xd3e4e437, 0xf279798b, 0xd5e7e732, 0x8bc8c843, 0x6e373759, 0xda6d6db7,
+    0x018d8d8c, 0xb1d5d564, 0x9c4e4ed2, 0x49a9a9e0, 0xd86c6cb4, 0xac5656fa,
+    0xf3f4f407, 0xcfeaea25, 0xca6565af, 0xf47a7a8e, 0x47aeaee9, 0x10080818,
+    0x6fbabad5, 0xf0787888, 0x4a25256f, 0x5c2e2e72, 0x381c1c24, 0x57a6a6f1,
+    0x73b4b4c7, 0x97c6c651, 0xcbe8e823, 0xa1dddd7c, 0xe874749c, 0x3e1f1f21,
+    0x964b4bdd, 0x61bdbddc, 0x0d8b8b86, 0x0f8a8a85, 0xe0707090, 0x7c3e3e42,
+    0x71b5b5c4, 0xcc6666aa, 0x904848d8, 0x06030305, 0xf7f6f601, 0x1c0e0e12,
+    0xc26161a3, 0x6a35355f, 0xae5757f9, 0x69b9b9d0, 0x17868691, 0x99c1c158,
+    0x3a1d1d27, 0x279e9eb9, 0xd9e1e138, 0xebf8f813, 0x2b9898b3, 0x22111133,
+    0xd26969bb, 0xa9d9d970, 0x078e8e89, 0x339494a7, 0x2d9b9bb6, 0x3c1e1e22,
+    0x15878792, 0xc9e9e920, 0x87cece49, 0xaa5555ff, 0x50282878, 0xa5dfdf7a,
+    0x038c8c8f, 0x59a1a1f8, 0x09898980, 0x1a0d0d17, 0x65bfbfda, 0xd7e6e631,
+    0x844242c6, 0xd06868b8, 0x824141c3, 0x299999b0, 0x5a2d2d77, 0x1e0f0f11,
+    0x7bb0b0cb, 0xa85454fc, 0x6dbbbbd6, 0x2c16163a
+};
+#endif
+
+// Get a big-endian 32-bit integer from p.
+#define GET4B(p) \
+    (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+     ((uint32_t)(p)[2] << 8) | (p)[3])
+
+// Substitute the bytes of the 32-bit x using the S-box.
+#define SUB4(x) \
+    (((uint32_t)aes_s[(x) >> 24] << 24) | \
+     ((uint32_t)aes_s[((x) >> 16) & 0xff] << 16) | \
+     ((uint32_t)aes_s[((x) >> 8) & 0xff] << 8) | aes_s[(x) & 0xff])
+
+// Expand the 32-byte key for AES-256 encryption.
+static void aes_key(aes_t *aes, unsigned char const *key) {
+    uint32_t *rk = aes->rk;
+    for (int i = 0; i < 8; i++)
+        rk[i] = GET4B(key + 4 * i);
+    uint32_t rcon = 1;
+    for (int i = 8; i < 60; i++) {
+        uint32_t t = rk[i - 1];
+        if ((i & 7) == 0) {
+            t = SUB4(ROR(t, 24)) ^ (rcon << 24);
+            rcon <<= 1;
+        }
+        else if ((i & 7) == 4)
+            t = SUB4(t);
+        rk[i] = rk[i - 8] ^ t;
+    }
+#ifdef AESNI
+    unsigned char bytes[240];
+    for (int i = 0; i < 60; i++) {
+        bytes[4 * i] = rk[i] >> 24;
+        bytes[4 * i + 1] = rk[i] >> 16;
+        bytes[4 * i + 2] = rk[i] >> 8;
+        bytes[4 * i + 3] = rk[i];
+    }
+    for (int i = 0; i < 15; i++)
+        aes->xk[i] = _mm_loadu_si128((__m128i const *)(bytes + 16 * i));
+#endif
+}
+
+// Encrypt the 16-byte block in to out with AES-256. Without AES-NI, this uses
+// lookup tables, whose timing depends on the data, as for most portable AES
+// implementations.
+static void aes_encrypt(aes_t const *aes, unsigned char const *in,
+                        unsigned char *out) {
+#ifdef AESNI
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((__m128i const *)in),
+                              aes->xk[0]);
+    for (int r = 1; r < 14; r++)
+        b = _mm_aesenc_si128(b, aes->xk[r]);
+    _mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(b, aes->xk[14]));
+#else
+    uint32_t const *rk = aes->rk;
+    uint32_t s0 = GET4B(in) ^ rk[0], s1 = GET4B(in + 4) ^ rk[1],
+             s2 = GET4B(in + 8) ^ rk[2], s3 = GET4B(in + 12) ^ rk[3];
+#  define ROUND(a, b, c, d) \
+    (aes_mix[(a) >> 24] ^ ROR(aes_mix[((b) >> 16) & 0xff], 8) ^ \
+     ROR(aes_mix[((c) >> 8) & 0xff], 16) ^ ROR(aes_mix[(d) & 0xff], 24))
+    for (int r = 1; r < 14; r++) {
+        rk += 4;
+        uint32_t t0 = ROUND(s0, s1, s2, s3) ^ rk[0],
+                 t1 = ROUND(s1, s2, s3, s0) ^ rk[1],
+                 t2 = ROUND(s2, s3, s0, s1) ^ rk[2],
+                 t3 = ROUND(s3, s0, s1, s2) ^ rk[3];
+        s0 = t0;  s1 = t1;  s2 = t2;  s3 = t3;
+    }
+#  undef ROUND
+#  define LAST(a, b, c, d) \
+    (((uint32_t)aes_s[(a) >> 24] << 24) | \
+     ((uint32_t)aes_s[((b) >> 16) & 0xff] << 16) | \
+     ((uint32_t)aes_s[((c) >> 8) & 0xff] << 8) | aes_s[(d) & 0xff])
+    rk += 4;
+    uint32_t t[4] = {
+        LAST(s0, s1, s2, s3) ^ rk[0], LAST(s1, s2, s3, s0) ^ rk[1],
+        LAST(s2, s3, s0, s1) ^ rk[2], LAST(s3, s0, s1, s2) ^ rk[3]
+    };
+#  undef LAST
+    for (int i = 0; i < 4; i++) {
+        out[4 * i] = t[i] >> 24;
+        out[4 * i + 1] = t[i] >> 16;
+        out[4 * i + 2] = t[i] >> 8;
+        out[4 * i + 3] = t[i];
+    }
+#endif
+}
+
+// Fill buf with len bytes from the system's secure random source. Return 0 on
+// success, or -1 if not available.
+static int zip_random(unsigned char *buf, size_t len) {
+#ifdef _WIN32
+    return BCryptGenRandom(NULL, buf, (ULONG)len,
+                           BCRYPT_USE_SYSTEM_PREFERRED_RNG) == 0 ? 0 : -1;
+#else
+    FILE *src = fopen("/dev/urandom", "rb");
+    if (src == NULL)
+        return -1;
+    size_t got = fread(buf, 1, len, src);
+    fclose(src);
+    return got == len ? 0 : -1;
+#endif
+}
+
 // Write the size bytes at ptr to the zip file, updating the offset. If ptr is
 // NULL, then flush the output. If there is an error, block all subsequent
-// writes. All output to the stream goes through this function.
+// writes. All output to the stream goes through this function, so this is
+// where the zip file digest is computed, if requested.
 static void zip_put(zip_t *zip, void const *ptr, size_t size) {
     if (zip->bad)
         return;
-    if (zip->put(zip->handle, ptr, size))
+    probe(put__start, size);
+    uint64_t start = zip_clock();
+    int ret = zip->put(zip->handle, ptr, size);
+    uint64_t now = zip_clock();
+    zip->one.put_ns += now - start;
+    probe(put__done, size, ret);
+    zip->one.puts++;
+    if (ret)
         zip->bad = 1;
-    else
+    else {
         zip->off += size;
+        zip->one.out += size;
+        if (zip->whole && size) {
+            sha_update(&zip->zsha, ptr, size);
+            zip->one.hash_ns += zip_clock() - now;
+        }
+    }
 }
 
 // Default put() function for writing to the file zip->out.
@@ -126,7 +769,8 @@ static int zip_write(void *handle, void const *ptr, size_t size) {
     int ret = ptr == NULL ? fflush(zip->out) :
                             fwrite(ptr, 1, size, zip->out) < size;
     if (ret)
-        warn("write error: %s -- aborting", strerror(errno));
+        warn(ZIP_WRITE, errno, "write error: %s -- aborting",
+             strerror(errno));
     return ret;
 }
 
@@ -134,33 +778,68 @@ static int zip_write(void *handle, void const *ptr, size_t size) {
 // allocations for the path and list of headers. Fire up the deflate engine,
 // using level for the compression level.
 static ZIP *zip_init(int level) {
-    zip_t *zip = malloc(sizeof(zip_t));
-    assert(zip != NULL && "out of memory");
+    zip_t *zip = mem_alloc(&zip_mem, sizeof(zip_t));
+    zip->mem = zip_mem;
     zip->handle = NULL;
     zip->put = NULL;
     zip->out = NULL;
-    zip->data = malloc(CHUNK);
-    zip->comp = malloc(CHUNK);
-    assert(zip->data != NULL && zip->comp != NULL && "out of memory");
+    zip->data = zip_alloc(zip, CHUNK);
+    zip->comp = zip_alloc(zip, CHUNK);
     zip->off = 0;
+    zip->base = 0;
+    zip->old = 0;
+    zip->seek = 0;
     zip->id = ID;
     zip->bad = 0;
     zip->omit = 0;
     zip->feed = 0;
     zip->level = level;
+    zip->align = 0;
+    zip->known = 0;
+    zip->rbits = 0;
+    zip->rhash = 0;
+    zip->span = 0;
+    zip->fed = 0;
+    zip->mark = 0;
+    zip->fixed = 0;
+    zip->pinned = 0;
+    zip->epoch = -1;
     zip->plen = 0;
     zip->pmax = 512;
-    zip->path = malloc(zip->pmax);
-    assert(zip->path != NULL && "out of memory");
+    zip->path = zip_alloc(zip, zip->pmax);
     zip->hnum = 0;
     zip->hmax = 512;
-    zip->head = malloc(zip->hmax * sizeof(head_t));
-    assert(zip->head != NULL && "out of memory");
+    zip->head = zip_alloc(zip, zip->hmax * sizeof(head_t));
     zip->hook = NULL;
     zip->log = NULL;
-    zip->strm.zalloc = Z_NULL;
-    zip->strm.zfree = Z_NULL;
-    zip->strm.opaque = Z_NULL;
+    zip->dhook = NULL;
+    zip->diag = NULL;
+    zip->thook = NULL;
+    zip->track = NULL;
+    zip->phook = NULL;
+    zip->progress = NULL;
+    zip->sizes = NULL;
+    zip->shook = NULL;
+    zip->digest = NULL;
+    zip->ihandle = NULL;
+    zip->iput = NULL;
+    zip->start = 0;
+    zip->whole = 0;
+    zip->hashed = 0;
+    zip->crypt = 0;
+    memset(&zip->all, 0, sizeof(zip_stats_t));
+    memset(&zip->one, 0, sizeof(zip_stats_t));
+    zip_held(zip, zip->pmax + zip->hmax * sizeof(head_t), 0);
+    if (zip->mem.alloc == NULL) {
+        zip->strm.zalloc = Z_NULL;
+        zip->strm.zfree = Z_NULL;
+        zip->strm.opaque = Z_NULL;
+    }
+    else {
+        zip->strm.zalloc = zip_zalloc;
+        zip->strm.zfree = zip_zfree;
+        zip->strm.opaque = zip;
+    }
     int ret = deflateInit2(&zip->strm, level, Z_DEFLATED, -15, 8,
                            Z_DEFAULT_STRATEGY);     // raw deflate
     assert(ret == Z_OK && "out of memory");
@@ -184,21 +863,34 @@ static ZIP *zip_init(int level) {
         PUT4((p) + 4, (uint64_t)(v) >> 32); \
     } while (0)
 
+// Thread-safe localtime(), or gmtime() if utc is true, so that separate zip
+// streams can be run concurrently in different threads. Return NULL on error.
+static struct tm *zip_localtime(time_t const *clock, struct tm *tm, int utc) {
+#ifdef _WIN32
+    return (utc ? gmtime_s(tm, clock) : localtime_s(tm, clock)) ? NULL : tm;
+#else
+    return utc ? gmtime_r(clock, tm) : localtime_r(clock, tm);
+#endif
+}
+
 // Convert the Unix time clock to DOS time in the four bytes at *dos. If there
 // is a conversion error for any reason, store the current time in DOS format
-// at *dos. The Unix time in seconds is rounded up to an even number of
-// seconds, since the DOS time can only represent even seconds. If the Unix
-// time is before 1980, the minimum DOS time of Jan 1, 1980 is used.
-static void put_time(unsigned char *dos, time_t clock) {
+// at *dos, unless fixed is true, in which case the minimum DOS time is used.
+// If fixed is true, the DOS time is in UTC instead of the local time zone. The
+// Unix time in seconds is rounded up to an even number of seconds, since the
+// DOS time can only represent even seconds. If the Unix time is before 1980,
+// the minimum DOS time of Jan 1, 1980 is used.
+static void put_time(unsigned char *dos, time_t clock, int fixed) {
     clock += clock & 1;
-    struct tm *s = localtime(&clock);
-    if (s == NULL) {
+    struct tm tm;
+    struct tm *s = zip_localtime(&clock, &tm, fixed);
+    if (s == NULL && !fixed) {
         clock = time(NULL);             // on error, use current time
         clock += clock & 1;
-        s = localtime(&clock);
+        s = zip_localtime(&clock, &tm, 0);
         assert(s != NULL && "internal error");
     }
-    if (s->tm_year < 80) {              // no DOS time before 1980
+    if (s == NULL || s->tm_year < 80) { // no DOS time before 1980
         dos[0] = 0;  dos[1] = 0;                // use midnight,
         dos[2] = (1 << 5) + 1;  dos[3] = 0;     // Jan 1, 1980
     }
@@ -216,27 +908,328 @@ static void put_time(unsigned char *dos, time_t clock) {
      zip->level == 2 ? 4 : \
      zip->level == 1 ? 6 : 0)
 
-// Write a local header with the information in the last header slot.
+// Lengths of the WinZip AES-256 salt, password verifier, and authentication
+// code. The salt and verifier precede the encrypted data, and the code follows
+// it, all counted in the compressed length.
+#define SALT 16
+#define VERIFY 2
+#define AUTH 10
+
+// Put the WinZip AES extra field for AE-2 with AES-256 and the compression
+// method in the 11 bytes at extra.
+static void put_aes(unsigned char *extra, unsigned method) {
+    PUT2(extra, 0x9901);            // WinZip AES extra field id
+    PUT2(extra + 2, 7);             // length of the remainder
+    PUT2(extra + 4, 2);             // AE-2: no CRC-32, authentication only
+    extra[6] = 'A';                 // vendor id
+    extra[7] = 'E';
+    extra[8] = 3;                   // AES-256
+    PUT2(extra + 9, method);        // actual compression method
+}
+
+// Start encrypting the entry. Make a new salt from the random seed, derive the
+// AES-256 key, the HMAC-SHA1 key, and the password verifier from the salt and
+// the password, and write the salt and verifier. Each entry gets its own salt
+// and keys, since WinZip AES starts the CTR mode counter at one for every
+// entry, and reusing a key would reuse the key stream.
+static void zip_seal(zip_t *zip) {
+    uint64_t start = zip_clock();
+    unsigned char num[8], salt[32], key[66];
+    PUT8(num, zip->salts);
+    zip->salts++;
+    sha_t sha;
+    sha_init(&sha);
+    sha_update(&sha, zip->seed, sizeof(zip->seed));
+    sha_update(&sha, num, sizeof(num));
+    sha_final(&sha, salt);
+    pbkdf2(&zip->pass, salt, SALT, key, sizeof(key));
+    aes_key(&zip->aes, key);
+    hmac_key(&zip->auth, key + 32, 32);
+    memset(zip->ctr, 0, sizeof(zip->ctr));
+    zip->used = sizeof(zip->pad);
+    memcpy(salt + SALT, key + 64, VERIFY);
+    zip_wipe(key, sizeof(key));
+    zip->one.crypt_ns += zip_clock() - start;
+    zip_put(zip, salt, SALT + VERIFY);
+}
+
+// Encrypt the len bytes at buf in place with AES-256 in CTR mode, with the
+// little-endian counter of WinZip AES, and add the encrypted bytes to the
+// authentication code.
+static void zip_cipher(zip_t *zip, unsigned char *buf, size_t len) {
+    uint64_t start = zip_clock();
+    unsigned char *next = buf;
+    size_t left = len;
+    while (left) {
+        if (zip->used == sizeof(zip->pad)) {
+            for (int j = 0; j < 8 && ++zip->ctr[j] == 0; j++)
+                ;
+            aes_encrypt(&zip->aes, zip->ctr, zip->pad);
+            zip->used = 0;
+        }
+        size_t n = sizeof(zip->pad) - zip->used;
+        if (n > left)
+            n = left;
+        for (size_t i = 0; i < n; i++)
+            next[i] ^= zip->pad[zip->used + i];
+        zip->used += n;
+        next += n;
+        left -= n;
+    }
+    sha_update(&zip->auth.in, buf, len);
+    zip->one.crypt_ns += zip_clock() - start;
+}
+
+// Complete encrypting the entry in head. Write the authentication code, and
+// include the salt, verifier, and code in the compressed length. AE-2 entries
+// have no CRC-32, since the authentication code serves its purpose without
+// leaking information about the unencrypted data.
+static void zip_auth(zip_t *zip, head_t *head) {
+    unsigned char mac[20];
+    hmac_done(&zip->auth, &zip->auth.in, mac);
+    zip_put(zip, mac, AUTH);
+    head->clen += SALT + VERIFY + AUTH;
+    head->crc = 0;
+}
+
+// General purpose bit flags for the entry head: UTF-8 name, data descriptor
+// if used, compression level if deflated, and encrypted if locked. The flags
+// of an old entry from zip_append() are kept as they were.
+#define FLAGS(head) \
+    (((head)->method == 8 || (head)->need ? (head)->flags : \
+      (head)->flags & ~6) + \
+     ((head)->desc ? 8 : 0) + (head)->lock)
+
+// Write a local header with the information in the last header slot. If the
+// entry is to be encrypted, start that, which writes the salt and verifier.
 static void zip_local(zip_t *zip) {
     head_t const *head = zip->head + zip->hnum;
 
+    // If the length and CRC-32 were provided by zip_known(), then the entry is
+    // stored, and those go in the local header, with a zip64 extended
+    // information field if needed. Otherwise they are left as zeros, to be
+    // provided by the data descriptor, or by zip_patch() if seeking. A stored
+    // entry when seeking gets a zip64 extended information field of zeros,
+    // for zip_patch() to fill in if the lengths turn out to need 64 bits.
+    uint64_t ulen = 0, clen = 0;
+    uint32_t crc = 0;
+    unsigned char zip64[20];
+    unsigned zlen = 0;
+    if (zip->known) {
+        ulen = zip->size;
+        clen = ulen + (head->lock ? SALT + VERIFY + AUTH : 0);
+        crc = head->lock ? 0 : head->crc;
+        if (ulen >= MAX32 || clen >= MAX32) {
+            PUT2(zip64, 1);         // zip64 extended information id
+            PUT2(zip64 + 2, 16);    // length of the remainder
+            PUT8(zip64 + 4, ulen);  // uncompressed length
+            PUT8(zip64 + 12, clen); // compressed length
+            zlen = 20;
+        }
+    }
+    else if (zip->seek && head->method == 0) {
+        memset(zip64, 0, sizeof(zip64));
+        PUT2(zip64, 1);             // zip64 extended information id
+        PUT2(zip64 + 2, 16);        // length of the remainder
+        zlen = 20;
+    }
+
+    // If requested, align the data of an unencrypted stored entry in the zip
+    // file, using the Android zipalign extra field as the last extra field to
+    // pad the local header: the alignment, followed by zeros.
+    unsigned alen = 0;
+    if (zip->align && head->method == 0 && !head->lock) {
+        uint64_t end = head->off + 30 + head->nlen + zlen + 6;
+        alen = 6 + (unsigned)(-end & (zip->align - 1));
+    }
+
     // Local header.
     unsigned char local[30];
     PUT4(local, 0x04034b50);        // local file header signature
-    PUT2(local + 4,                 // version needed to extract (2.0 or 4.5)
-         head->off >= MAX32 ? 45 : 20);
-    PUT2(local + 6, 0x808 + LEVEL());   // UTF-8 name, level, data descriptor
-    PUT2(local + 8, 8);             // deflate compression method
-    put_time(local + 10, head->mtime);  // modified time and date (4 bytes)
-    PUT4(local + 14, 0);            // CRC-32 (in data descriptor)
-    PUT4(local + 18, 0);            // compressed size (in data descriptor)
-    PUT4(local + 22, 0);            // uncompressed size (in data descriptor)
+    PUT2(local + 4,                 // version needed (2.0, 4.5, or 5.1)
+         head->lock ? 51 : zlen || head->off >= MAX32 ? 45 : 20);
+    PUT2(local + 6, FLAGS(head));   // general purpose bit flags
+    PUT2(local + 8,                 // stored, deflate, or WinZip AES method
+         head->lock ? 99 : head->method);
+    put_time(local + 10, head->mtime, zip->fixed); // modified time and date
+    PUT4(local + 14, crc);          // CRC-32 (or in descriptor)
+    PUT4(local + 18,                // compressed size (or in descriptor)
+         zlen ? MAX32 : clen);
+    PUT4(local + 22,                // uncompressed size (or in descriptor)
+         zlen ? MAX32 : ulen);
     PUT2(local + 26, head->nlen);   // file name length (name follows header)
-    PUT2(local + 28, 0);            // extra field length
+    PUT2(local + 28,                // extra field length
+         zlen + (head->lock ? 11 : 0) + alen);
 
     // Write the local header.
     zip_put(zip, local, sizeof(local));
     zip_put(zip, head->name, head->nlen);
+    zip_put(zip, zip64, zlen);
+    if (alen) {
+        unsigned char pad[6];
+        PUT2(pad, 0xd935);          // zipalign extra field id
+        PUT2(pad + 2, alen - 4);    // length of the remainder
+        PUT2(pad + 4, zip->align);  // alignment
+        zip_put(zip, pad, sizeof(pad));
+
+        // The zeros can be longer than CHUNK on a 16-bit system, so write
+        // them in pieces.
+        unsigned zeros = alen - 6, max = zeros > CHUNK ? CHUNK : zeros;
+        memset(zip->comp, 0, max);
+        while (zeros) {
+            unsigned n = zeros > max ? max : zeros;
+            zip_put(zip, zip->comp, n);
+            zeros -= n;
+        }
+    }
+    if (head->lock) {
+        unsigned char aes[11];
+        put_aes(aes, head->method);
+        zip_put(zip, aes, sizeof(aes));
+    }
+    zip->start = zip->off;
+    if (head->lock)
+        zip_seal(zip);
+}
+
+// Call the registered progress() function, if any, if the requested number of
+// input bytes or amount of time has passed since the last call, or if force is
+// true. head is the entry in progress.
+static void zip_tick(zip_t *zip, head_t const *head, int force) {
+    if (zip->progress == NULL)
+        return;
+    uint64_t in = zip->all.ulen + head->ulen;
+    uint64_t now = zip_clock();
+    if (force || in - zip->pin >= zip->pbytes ||
+        now - zip->ptime >= zip->pns) {
+        zip->progress(zip->phook, head->name, in, zip->off);
+        zip->pin = in;
+        zip->ptime = now;
+    }
+}
+
+// Write the len bytes at data as stored entry data, counting them in the
+// compressed length of head. If the entry is encrypted, then a copy in
+// zip->comp is encrypted and written, a chunk at a time. data may be zip->comp
+// if len is no more than CHUNK.
+static void zip_store(zip_t *zip, head_t *head, void const *data, size_t len) {
+    head->clen += len;
+    if (!head->lock)
+        zip_put(zip, data, len);
+    else {
+        unsigned char const *next = data;
+        while (len) {
+            size_t n = len < CHUNK ? len : CHUNK;
+            if (next != zip->comp)
+                memcpy(zip->comp, next, n);
+            zip_cipher(zip, zip->comp, n);
+            zip_put(zip, zip->comp, n);
+            next += n;
+            len -= n;
+        }
+    }
+    zip_tick(zip, head, 0);
+}
+
+// Compress the zip->strm.avail_in bytes at zip->strm.next_in, writing the
+// compressed data to the output. flush is Z_NO_FLUSH, Z_FULL_FLUSH, or
+// Z_FINISH. Update the compressed length in head. Return the last return value
+// from deflate(). Abandon the deflate process if a write error is encountered,
+// which is assumed to be persistent.
+static int zip_crunch(zip_t *zip, head_t *head, int flush) {
+    int ret;
+    do {
+        zip->strm.avail_out = CHUNK;
+        zip->strm.next_out = zip->comp;
+        probe(deflate__start, zip->strm.avail_in, flush);
+        uint64_t start = zip_clock();
+        ret = deflate(&zip->strm, flush);
+        zip->one.deflate_ns += zip_clock() - start;
+        probe(deflate__done, zip->strm.avail_in,
+              CHUNK - zip->strm.avail_out, ret);
+        if (head->lock)
+            zip_cipher(zip, zip->comp, CHUNK - zip->strm.avail_out);
+        zip_put(zip, zip->comp, CHUNK - zip->strm.avail_out);
+        if (zip->bad)
+            break;                  // abandon compression on write error
+        head->clen += CHUNK - zip->strm.avail_out;
+        zip_tick(zip, head, 0);
+        // Continue until all input consumed and all output delivered.
+    } while (zip->strm.avail_out == 0);
+    return ret;
+}
+
+// Compress the zip->strm.avail_in bytes at zip->strm.next_in with
+// zip_crunch(). If rsyncable output was requested, also end the deflate
+// stream's history with a full flush after each input byte where the rolling
+// hash of the last zip->rbits bytes hits. The hash carries over between calls
+// for the same entry in zip->rhash.
+static int zip_roll(zip_t *zip, head_t *head, int flush) {
+    if (zip->rbits) {
+        uint32_t mask = ((uint32_t)1 << zip->rbits) - 1;
+        uint32_t hit = mask >> 1, hash = zip->rhash;
+        unsigned char const *scan = zip->strm.next_in;
+        unsigned char const *end = scan + zip->strm.avail_in;
+        while (scan < end) {
+            hash = ((hash << 1) ^ *scan++) & mask;
+            if (hash == hit) {
+                // Compress through this byte, and flush.
+                zip->strm.avail_in = scan - zip->strm.next_in;
+                zip_crunch(zip, head, Z_FULL_FLUSH);
+                if (zip->bad)
+                    return Z_OK;
+                zip->one.syncs++;
+            }
+        }
+        zip->rhash = hash;
+        zip->strm.avail_in = end - zip->strm.next_in;
+        if (zip->strm.avail_in == 0 && flush == Z_NO_FLUSH)
+            return Z_OK;
+    }
+    return zip_crunch(zip, head, flush);
+}
+
+// Write the len bytes at ptr to the index. If the index put() fails, then
+// abort the zip file as for a write error, since the index would no longer
+// match it.
+static void zip_iput(zip_t *zip, void const *ptr, size_t len) {
+    if (!zip->bad && zip->iput(zip->ihandle, ptr, len))
+        zip->bad = 1;
+}
+
+// Write a seek point index record for the entry head, at the current input
+// and compressed offsets in the entry. See zip_index() in zipflow.h.
+static void zip_point(zip_t *zip, head_t const *head) {
+    unsigned char rec[32] = {2};    // seek point record type
+    PUT4(rec + 4, sizeof(rec));     // record length
+    PUT8(rec + 8, zip->fed);        // offset in the uncompressed data
+    PUT8(rec + 16, head->clen);     // offset in the compressed data
+    PUT8(rec + 24, head->off);      // local header offset of the entry
+    zip_iput(zip, rec, sizeof(rec));
+}
+
+// Compress the zip->strm.avail_in bytes at zip->strm.next_in with zip_roll().
+// If seek points were requested, also do a full flush after every zip->span
+// bytes of the entry's input, which can be inflated from with no history, and
+// record each in the index, if any. A seek point is made only once there is
+// input after it, so that there is none at the end of the entry.
+static int zip_sync(zip_t *zip, head_t *head, int flush) {
+    if (zip->span) {
+        unsigned char const *end = zip->strm.next_in + zip->strm.avail_in;
+        while (zip->mark - zip->fed < zip->strm.avail_in) {
+            zip->strm.avail_in = zip->mark - zip->fed;
+            zip_roll(zip, head, Z_FULL_FLUSH);
+            if (zip->bad)
+                return Z_OK;
+            zip->fed = zip->mark;
+            zip->mark += zip->span;
+            if (zip->iput != NULL)
+                zip_point(zip, head);
+            zip->strm.avail_in = end - zip->strm.next_in;
+        }
+        zip->fed += zip->strm.avail_in;
+    }
+    return zip_roll(zip, head, flush);
 }
 
 // Compress the file in using deflate, writing the compressed data to zip->out.
@@ -248,42 +1241,111 @@ static void zip_deflate(zip_t *zip, FILE *in) {
     head->ulen = 0;
     head->clen = 0;
     head->crc = crc32(0, Z_NULL, 0);
-    zip->strm.avail_in = 0;
-    int eof = 0, ret;
+    zip->rhash = 0;
+    zip->fed = 0;
+    zip->mark = zip->span;
+    zip->hashed = zip->digest != NULL;
+    if (zip->hashed)
+        sha_init(&zip->esha);
+    int eof, ret;
     do {
-        if (zip->strm.avail_in == 0 && !eof) {
-            zip->strm.avail_in = fread(zip->data, 1, CHUNK, in);
-            zip->strm.next_in = zip->data;
-            head->ulen += zip->strm.avail_in;
-            head->crc = crc32(head->crc, zip->data, zip->strm.avail_in);
-            if (zip->strm.avail_in < CHUNK) {
-                eof = 1;
-                if (ferror(in)) {
-                    warn("read error on %s: %s -- entry omitted",
-                         zip->path, strerror(errno));
-                    zip->omit = 1;  // finish, but omit from directory
-                }
-            }
+        uint64_t start = zip_clock();
+        zip->strm.avail_in = fread(zip->data, 1, CHUNK, in);
+        zip->strm.next_in = zip->data;
+        uint64_t now = zip_clock();
+        zip->one.read_ns += now - start;
+        zip->one.reads++;
+        head->ulen += zip->strm.avail_in;
+        head->crc = crc32(head->crc, zip->data, zip->strm.avail_in);
+        start = zip_clock();
+        zip->one.crc_ns += start - now;
+        if (zip->hashed) {
+            sha_update(&zip->esha, zip->data, zip->strm.avail_in);
+            zip->one.hash_ns += zip_clock() - start;
         }
-        zip->strm.avail_out = CHUNK;
-        zip->strm.next_out = zip->comp;
-        ret = deflate(&zip->strm, eof ? Z_FINISH : Z_NO_FLUSH);
-        zip_put(zip, zip->comp, CHUNK - zip->strm.avail_out);
+        eof = zip->strm.avail_in < CHUNK;
+        if (eof && ferror(in)) {
+            warn(ZIP_READ, errno, "read error on %s: %s -- entry omitted",
+                 zip->path, strerror(errno));
+            zip->omit = 1;          // finish, but omit from directory
+        }
+        if (head->method == 0) {
+            zip_store(zip, head, zip->data, zip->strm.avail_in);
+            ret = Z_STREAM_END;
+        }
+        else
+            ret = zip_sync(zip, head, eof ? Z_FINISH : Z_NO_FLUSH);
         if (zip->bad)
             return;                 // abandon compression on write error
-        head->clen += CHUNK - zip->strm.avail_out;
-    } while (ret == Z_OK);
+    } while (!eof);
     assert(ret == Z_STREAM_END && "internal error");
-    deflateReset(&zip->strm);       // prepare for next use of engine
+    if (head->method)
+        deflateReset(&zip->strm);   // prepare for next use of engine
+}
+
+// Complete the local header of the entry head in place, now that its lengths
+// and CRC-32 are known, by seeking back in the output file. A stored entry
+// has a zip64 extended information field reserved by zip_local(), which gets
+// the lengths if they need 64 bits. For a deflated entry with lengths that
+// need 64 bits, there is no room for them in the local header. In that case,
+// the header is instead changed to say that a data descriptor follows, and
+// head->desc is set so that one is written. That can't be done for a stored
+// entry, since a reader would not be able to find the end of its data.
+static void zip_patch(zip_t *zip, head_t *head) {
+    unsigned char fix[12], zip64[16];
+    size_t len, at;
+    int big = head->ulen >= MAX32 || head->clen >= MAX32;
+    if (big && head->method != 0) {
+        head->desc = 1;
+        PUT2(fix, head->lock ? 51 : 45);    // version needed (4.5 or 5.1)
+        PUT2(fix + 2, FLAGS(head)); // general purpose bit flags
+        len = 4;
+        at = 4;
+    }
+    else {
+        PUT4(fix, head->crc);       // CRC-32
+        PUT4(fix + 4,               // compressed size
+             big ? MAX32 : head->clen);
+        PUT4(fix + 8,               // uncompressed size
+             big ? MAX32 : head->ulen);
+        len = 12;
+        at = 14;
+    }
+    PUT8(zip64, head->ulen);        // uncompressed length
+    PUT8(zip64 + 8, head->clen);    // compressed length
+    uint64_t start = zip_clock();
+    int ret = fseeko(zip->out, zip->base + head->off + at, SEEK_SET) ||
+              fwrite(fix, 1, len, zip->out) < len ||
+              (head->method == 0 &&
+               (fseeko(zip->out, zip->base + head->off + 30 + head->nlen + 4,
+                       SEEK_SET) ||
+                fwrite(zip64, 1, sizeof(zip64), zip->out) < sizeof(zip64))) ||
+              fseeko(zip->out, zip->base + zip->off, SEEK_SET);
+    zip->one.put_ns += zip_clock() - start;
+    zip->one.puts++;
+    if (ret) {
+        warn(ZIP_WRITE, errno, "write error: %s -- aborting",
+             strerror(errno));
+        zip->bad = 1;
+    }
 }
 
 // Write a data descriptor with the information in the last header slot. The
 // descriptor can use either 32-bit or 64-bit fields for the compressed and
 // uncompressed lengths. The size must be determined by the same logic that
 // decides on an extended information field in the central directory header.
-// That is why the offset requiring 64-bits will drive this to 64-bits.
+// That is why the offset requiring 64-bits will drive this to 64-bits. If the
+// entry is encrypted, this first completes that. If seeking, the local header
+// is completed instead, if possible. If the entry has no data descriptor, then
+// only that is done.
 static void zip_desc(zip_t *zip) {
-    head_t const *head = zip->head + zip->hnum;
+    head_t *head = zip->head + zip->hnum;
+    if (head->lock)
+        zip_auth(zip, head);
+    if (zip->seek && !zip->known && !zip->bad)
+        zip_patch(zip, head);
+    if (!head->desc)
+        return;
     unsigned char desc[24];
     PUT4(desc, 0x08074b50);         // data descriptor signature
     PUT4(desc + 4, head->crc);      // uncompressed data CRC-32
@@ -301,12 +1363,80 @@ static void zip_desc(zip_t *zip) {
     }
 }
 
+// Return the 64-bit FNV-1a hash of the len bytes at name.
+static uint64_t fnv1a(char const *name, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3;
+    return hash;
+}
+
+// Write the index record for the entry head. See zip_index() in zipflow.h for
+// the format.
+static void zip_record(zip_t *zip, head_t const *head) {
+    unsigned char rec[56];
+    rec[0] = 1;                     // entry record type
+    rec[1] = head->lock ? 99 : head->method;    // method as in the headers
+    PUT2(rec + 2, head->nlen);      // name length (name follows record)
+    PUT4(rec + 4, sizeof(rec) + head->nlen);    // record length
+    PUT4(rec + 8, head->crc);       // CRC-32 as in the headers
+    PUT2(rec + 12, FLAGS(head));    // general purpose bit flags
+    PUT2(rec + 14, 0);              // (reserved)
+    PUT8(rec + 16, fnv1a(head->name, head->nlen));  // name hash
+    PUT8(rec + 24, head->off);      // local header offset
+    PUT8(rec + 32, zip->start);     // data offset
+    PUT8(rec + 40, head->clen);     // compressed length
+    PUT8(rec + 48, head->ulen);     // uncompressed length
+    zip_iput(zip, rec, sizeof(rec));
+    zip_iput(zip, head->name, head->nlen);
+}
+
+// Complete the statistics for the entry just written, deliver them to the
+// registered track() function, if any, and start the statistics for the next
+// entry. If the entry was omitted from the directory, it is not counted.
+static void zip_tally(zip_t *zip) {
+    head_t const *head = zip->head + zip->hnum;
+    zip->one.entries = !zip->omit;
+    zip->one.ulen = head->ulen;
+    zip->one.clen = head->clen;
+    zip->one.meta = zip->all.meta;
+    zip->one.peak = zip->all.peak;
+    probe(entry__done, head->name, head->ulen, head->clen, zip->omit);
+    if (zip->digest != NULL && !zip->omit) {
+        unsigned char sum[32];
+        if (zip->hashed)
+            sha_final(&zip->esha, sum);
+        zip->digest(zip->shook, head->name, zip->hashed ? sum : NULL);
+    }
+    zip->hashed = 0;
+    if (zip->iput != NULL && !zip->omit)
+        zip_record(zip, head);
+    zip_tick(zip, head, 1);
+    if (zip->track != NULL)
+        zip->track(zip->thook, head->name, &zip->one);
+    zip_fold(zip);
+}
+
+// Keep the entry just written for the central directory, or if it was omitted,
+// free its name.
+static void zip_keep(zip_t *zip) {
+    if (zip->omit) {
+        head_t *head = zip->head + zip->hnum;
+        zip_free(zip, head->name, head->nlen + 1);
+        zip_held(zip, 0, head->nlen + 1);
+        zip->omit = 0;
+    }
+    else
+        zip->hnum++;
+}
+
 // Set up for next zip entry by assuring a slot for the next set of metadata.
 static void zip_next(zip_t *zip) {
     if (zip->hnum == zip->hmax) {
+        zip_held(zip, zip->hmax * sizeof(head_t), 0);
+        zip->head = zip_realloc(zip, zip->head, zip->hmax * sizeof(head_t),
+                                (zip->hmax << 1) * sizeof(head_t));
         zip->hmax <<= 1;
-        zip->head = realloc(zip->head, zip->hmax * sizeof(head_t));
-        assert(zip->head != NULL && "out of memory");
     }
 }
 
@@ -317,16 +1447,20 @@ static void zip_next(zip_t *zip) {
 static void zip_file(zip_t *zip) {
     // Check name length.
     if (zip->plen > 65535) {
-        warn("file name is too long for the zip format! -- skipping %s",
+        warn(ZIP_LONG, 0,
+             "file name is too long for the zip format! -- skipping %s",
              zip->path);
         return;
     }
 
     // Make sure we can open it for reading first. We know it's there, but
     // perhaps we don't have permission to read it.
+    zip_fold(zip);
     FILE *in = fopen(zip->path, "rb");
+    zip->one.opens++;
     if (in == NULL) {
-        warn("could not open %s for reading -- skipping", zip->path);
+        warn(ZIP_OPEN, errno, "could not open %s for reading -- skipping",
+             zip->path);
         return;
     }
 
@@ -334,11 +1468,24 @@ static void zip_file(zip_t *zip) {
     head_t *head = zip->head + zip->hnum;
 
     // Save the name and local header offset in the header structure.
-    head->name = malloc(zip->plen + 1);
-    assert(head->name != NULL && "out of memory");
+    head->name = zip_alloc(zip, zip->plen + 1);
+    zip_held(zip, zip->plen + 1, 0);
     memcpy(head->name, zip->path, zip->plen + 1);
     head->nlen = zip->plen;
     head->off = zip->off;
+    head->lock = zip->crypt;
+    head->method = zip->seek && zip->level == 0 ? 0 : 8;
+    head->desc = !zip->seek;
+    head->flags = 0x800 + LEVEL();
+    head->need = 0;
+#ifdef _WIN32
+    if (zip->fixed)
+        // Use the zip format's separator, for the same names on all systems.
+        for (char *sep = head->name; (sep = strchr(sep, '\\')) != NULL;)
+            *sep++ = '/';
+#endif
+
+    probe(entry__start, head->name, zip->level);
 
     // Write the local header, compressed data, and data descriptor, and update
     // the entry count. zip_deflate() sets the CRC-32 and lengths in the header
@@ -349,12 +1496,8 @@ static void zip_file(zip_t *zip) {
     zip_deflate(zip, in);
     fclose(in);
     zip_desc(zip);
-    if (zip->omit) {
-        free(head->name);
-        zip->omit = 0;
-    }
-    else
-        zip->hnum++;
+    zip_tally(zip);
+    zip_keep(zip);
 }
 
 // Assure that there are at least want bytes available for the path name.
@@ -364,11 +1507,90 @@ static void zip_room(zip_t *zip, size_t want) {
         need <<= 1;
     if (need == zip->pmax)
         return;
-    zip->path = realloc(zip->path, need);
-    assert(zip->path != NULL && "out of memory");
+    zip_held(zip, need, zip->pmax);
+    zip->path = zip_realloc(zip, zip->path, zip->pmax, need);
     zip->pmax = need;
 }
 
+// Names in a directory, to be sorted for reproducible output.
+typedef struct {
+    char **name;                // names (each allocated)
+    size_t num;                 // number of names
+    size_t max;                 // names allocation count
+} list_t;
+
+// Add a copy of name to list.
+static void list_add(zip_t *zip, list_t *list, char const *name) {
+    if (list->num == list->max) {
+        size_t max = list->max ? list->max << 1 : 64;
+        list->name = zip_realloc(zip, list->name,
+                                 list->max * sizeof(char *),
+                                 max * sizeof(char *));
+        list->max = max;
+    }
+    size_t len = strlen(name);
+    char *copy = zip_alloc(zip, len + 1);
+    memcpy(copy, name, len + 1);
+    list->name[list->num++] = copy;
+}
+
+// Compare two names for qsort(), in byte order.
+static int list_cmp(void const *a, void const *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Free the names in list and the list itself.
+static void list_free(zip_t *zip, list_t *list) {
+    for (size_t i = 0; i < list->num; i++)
+        zip_free(zip, list->name[i], strlen(list->name[i]) + 1);
+    zip_free(zip, list->name, list->max * sizeof(char *));
+}
+
+static void zip_scan(zip_t *zip);
+
+// Append a separator and name to the directory zip->path of length len, which
+// already has the separator at zip->path[len]. Process the new zip->path.
+static void zip_visit(zip_t *zip, size_t len, char const *name) {
+    size_t nlen = strlen(name);
+    zip_room(zip, len + 1 + nlen + 1);
+    memcpy(zip->path + len + 1, name, nlen + 1);
+    zip->plen = len + 1 + nlen;
+    zip_scan(zip);
+}
+
+// Process the names in list in sorted order, and free the list.
+static void zip_sorted(zip_t *zip, size_t len, list_t *list) {
+    if (list->num > 1)
+        qsort(list->name, list->num, sizeof(char *), list_cmp);
+    for (size_t i = 0; i < list->num; i++)
+        zip_visit(zip, len, list->name[i]);
+    list_free(zip, list);
+}
+
+// Normalize the metadata in head for reproducible output, if requested.
+// Windows metadata is converted to Unix metadata, times are limited to or set
+// to the epoch, the access time is made the modified time, and the permissions
+// are reduced to 0644, or 0755 if executable by anyone.
+static void zip_norm(zip_t *zip, head_t *head) {
+    if (!zip->fixed)
+        return;
+    if (head->os == 10) {
+        // Convert from 100 ns intervals since 1601 to seconds since 1970.
+        head->os = 3;
+        head->mode = 0100644 << 16;
+        head->mtime = head->mtime / 10000000 < 11644473600 ? 0 :
+                      head->mtime / 10000000 - 11644473600;
+    }
+    else
+        head->mode = (head->mode >> 16) & 0111 ? 0100755 << 16 :
+                                                 0100644 << 16;
+    if (zip->epoch >= 0 &&
+        (zip->pinned || head->mtime > (uint64_t)zip->epoch))
+        head->mtime = zip->epoch;
+    head->atime = head->mtime;
+    head->ctime = 0;
+}
+
 // Look for regular files to put in the zip file, recursively descending into
 // the directories. If zip->path is a regular file, then zip it. If zip->path
 // is a directory, call zip_scan() with each of the entries in that directory.
@@ -376,8 +1598,6 @@ static void zip_room(zip_t *zip, size_t want) {
 // Symbolic links are treated as the objects that they link to. zip_scan() is
 // operating system dependent.
 #ifdef _WIN32
-#  define WIN32_LEAN_AND_MEAN
-#  include <windows.h>
 #  include <locale.h>
 #  define OS 10
 static void zip_scan(zip_t *zip) {
@@ -387,14 +1607,18 @@ static void zip_scan(zip_t *zip) {
     HANDLE obj = CreateFileA(zip->path, GENERIC_READ, FILE_SHARE_READ, NULL,
                              OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
     if (obj == INVALID_HANDLE_VALUE) {
-        warn("could not open %s (%u) -- skipping", zip->path, GetLastError());
+        DWORD err = GetLastError();
+        warn(ZIP_STAT, err, "could not open %s (%u) -- skipping", zip->path,
+             err);
         return;
     }
     BY_HANDLE_FILE_INFORMATION info;
     int ret = GetFileInformationByHandle(obj, &info);
     CloseHandle(obj);
     if (ret == 0) {
-        warn("get %s info failed (%u) -- skipping", zip->path, GetLastError());
+        DWORD err = GetLastError();
+        warn(ZIP_STAT, err, "get %s info failed (%u) -- skipping", zip->path,
+             err);
         return;
     }
 
@@ -408,31 +1632,32 @@ static void zip_scan(zip_t *zip) {
         HANDLE dir = FindFirstFileA(zip->path, &meta);
         if (dir == INVALID_HANDLE_VALUE) {
             if (GetLastError() != ERROR_FILE_NOT_FOUND) {
-                warn("could not open directory %s (%u) -- skipping",
-                     zip->path, GetLastError());
+                DWORD err = GetLastError();
+                warn(ZIP_DIR, err,
+                     "could not open directory %s (%u) -- skipping",
+                     zip->path, err);
                 return;
             }
         }
         else {
+            list_t list = {NULL, 0, 0};
             do {
                 char const *name = meta.cFileName;
                 if (name[0] == '.' && (name[1] == 0 ||
                                        (name[1] == '.' && name[2] == 0)))
                     continue;           // ignore . and .. directories
-                size_t nlen = strlen(name);
-                if (memchr(name, '?', nlen) != NULL) {
+                if (strchr(name, '?') != NULL)
                     // The name could not be represented -- use alternate name.
                     name = meta.cAlternateFileName;
-                    nlen = strlen(name);
-                }
                 // Append the name to zip->path. Recursively process the new
-                // zip->path.
-                zip_room(zip, len + 1 + nlen + 1);
-                memcpy(zip->path + len + 1, name, nlen + 1);
-                zip->plen = len + 1 + nlen;
-                zip_scan(zip);
+                // zip->path. If reproducible, save the name for sorting.
+                if (zip->fixed)
+                    list_add(zip, &list, name);
+                else
+                    zip_visit(zip, len, name);
             } while (FindNextFileA(dir, &meta));
             FindClose(dir);
+            zip_sorted(zip, len, &list);
         }
 
         // Restore zip->path to what it was.
@@ -445,7 +1670,16 @@ static void zip_scan(zip_t *zip) {
         (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
         // zip->path is a device or a symbolic link to a directory. We discard
         // the latter in order to avoid recursion loops.
-        warn("%s is not a file or directory -- skipping", zip->path);
+        warn(ZIP_TYPE, 0, "%s is not a file or directory -- skipping",
+             zip->path);
+        return;
+    }
+
+    if (zip->sizes != NULL) {
+        // Only totaling the file sizes for zip_size().
+        zip->sizes[0] += info.nFileSizeLow |
+                         ((uint64_t)info.nFileSizeHigh << 32);
+        zip->sizes[1]++;
         return;
     }
 
@@ -462,6 +1696,7 @@ static void zip_scan(zip_t *zip) {
                   ((uint64_t)info.ftLastAccessTime.dwHighDateTime << 32);
     head->mtime = info.ftLastWriteTime.dwLowDateTime |
                   ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32);
+    zip_norm(zip, head);
     zip_file(zip);
 }
 #else   // Unix (assumes POSIX compatible)
@@ -473,7 +1708,7 @@ static void zip_scan(zip_t *zip) {
     struct stat st;
     int ret = stat(zip->path, &st);
     if (ret) {
-        warn("could not stat %s -- skipping", zip->path);
+        warn(ZIP_STAT, errno, "could not stat %s -- skipping", zip->path);
         return;
     }
 
@@ -481,11 +1716,13 @@ static void zip_scan(zip_t *zip) {
         // zip->path is a directory. Open and traverse the directory.
         DIR *dir = opendir(zip->path);
         if (dir == NULL) {
-            warn("could not open directory %s -- skipping", zip->path);
+            warn(ZIP_DIR, errno, "could not open directory %s -- skipping",
+                 zip->path);
             return;
         }
         size_t len = zip->plen;
         zip->path[len] = '/';
+        list_t list = {NULL, 0, 0};
         struct dirent *dp;
         while ((dp = readdir(dir)) != NULL) {
             char const *name = dp->d_name;
@@ -493,14 +1730,14 @@ static void zip_scan(zip_t *zip) {
                                    (name[1] == '.' && name[2] == 0)))
                 continue;           // ignore . and .. directories
             // Append a slash and the name to zip->path. Recursively process
-            // the new zip->path.
-            size_t nlen = strlen(name);
-            zip_room(zip, len + 1 + nlen + 1);
-            memcpy(zip->path + len + 1, name, nlen + 1);
-            zip->plen = len + 1 + nlen;
-            zip_scan(zip);
+            // the new zip->path. If reproducible, save the name for sorting.
+            if (zip->fixed)
+                list_add(zip, &list, name);
+            else
+                zip_visit(zip, len, name);
         }
         closedir(dir);
+        zip_sorted(zip, len, &list);
 
         // Restore zip->path to what it was.
         zip->path[len] = 0;
@@ -510,7 +1747,15 @@ static void zip_scan(zip_t *zip) {
 
     if ((st.st_mode & S_IFMT) != S_IFREG) {
         // zip->path may be a device, pipe, or socket.
-        warn("%s is not a file or directory -- skipping", zip->path);
+        warn(ZIP_TYPE, 0, "%s is not a file or directory -- skipping",
+             zip->path);
+        return;
+    }
+
+    if (zip->sizes != NULL) {
+        // Only totaling the file sizes for zip_size().
+        zip->sizes[0] += st.st_size;
+        zip->sizes[1]++;
         return;
     }
 
@@ -523,6 +1768,7 @@ static void zip_scan(zip_t *zip) {
     head->mode = (uint32_t)st.st_mode << 16;
     head->atime = st.st_atime;
     head->mtime = st.st_mtime;
+    zip_norm(zip, head);
     zip_file(zip);
 }
 #endif
@@ -579,19 +1825,26 @@ static void zip_central(zip_t *zip, head_t const *head) {
     // extended information field.
     unsigned char central[46];
     PUT4(central, 0x02014b50);      // central directory header signature
-    PUT2(central + 4,               // os, made by v4.5 equivalent
-         ((unsigned)head->os << 8) + 45);
-    PUT2(central + 6, zlen ? 45 : 20);  // version needed to extract
-    PUT2(central + 8, 0x808 + LEVEL()); // UTF-8 name, level, data descriptor
-    PUT2(central + 10, 8);          // deflate compression method
-    put_time(central + 12, head->mtime);    // modified time and date (4 bytes)
+    PUT2(central + 4,               // os, made by v4.5 or v5.1 equivalent
+         ((unsigned)head->os << 8) + (head->lock ? 51 : 45));
+    unsigned need = head->need ? head->need : 20;   // as it was, or 2.0
+    if (zlen && need < 45)
+        need = 45;                  // zip64 (4.5)
+    if (head->lock && need < 51)
+        need = 51;                  // WinZip AES (5.1)
+    PUT2(central + 6, need);        // version needed to extract
+    PUT2(central + 8, FLAGS(head)); // general purpose bit flags
+    PUT2(central + 10,              // stored, deflate, or WinZip AES method
+         head->lock ? 99 : head->method);
+    put_time(central + 12, head->mtime, zip->fixed);   // modified time, date
     PUT4(central + 16, head->crc);  // CRC-32
     PUT4(central + 20,              // compressed length
          head->clen >= MAX32 ? MAX32 : head->clen);
     PUT4(central + 24,              // uncompressed length
          head->ulen >= MAX32 ? MAX32 : head->ulen);
     PUT2(central + 28, head->nlen); // file name length (name after header)
-    PUT2(central + 30, zlen + xlen);    // extra field length (after name)
+    PUT2(central + 30,              // extra field length (after name)
+         zlen + xlen + (head->lock ? 11 : 0));
     PUT2(central + 32, 0);          // file comment length
     PUT2(central + 34, 0);          // starting disk
     PUT2(central + 36, 0);          // internal file attributes
@@ -604,6 +1857,11 @@ static void zip_central(zip_t *zip, head_t const *head) {
     zip_put(zip, head->name, head->nlen);
     zip_put(zip, zip64, zlen);
     zip_put(zip, stamp, xlen);
+    if (head->lock) {
+        unsigned char aes[11];
+        put_aes(aes, head->method);
+        zip_put(zip, aes, sizeof(aes));
+    }
 }
 
 // Write the zip file end records. The central directory started at offset beg
@@ -661,20 +1919,251 @@ static void zip_end(zip_t *zip, uint64_t beg) {
 // Free all allocated memory. Return true if a write error was noted.
 static int zip_clean(zip_t *zip) {
     deflateEnd(&zip->strm);
-    while (zip->hnum)
-        free(zip->head[--zip->hnum].name);
-    free(zip->head);
-    free(zip->path);
-    free(zip->comp);
-    free(zip->data);
+    while (zip->hnum) {
+        head_t *head = zip->head + --zip->hnum;
+        zip_free(zip, head->name, head->nlen + 1);
+    }
+    zip_free(zip, zip->head, zip->hmax * sizeof(head_t));
+    zip_free(zip, zip->path, zip->pmax);
+    zip_free(zip, zip->comp, CHUNK);
+    zip_free(zip, zip->data, CHUNK);
+    zip_wipe(zip->seed, sizeof(zip->seed));
+    zip_wipe(&zip->pass, sizeof(hmac_t));
+    zip_wipe(&zip->auth, sizeof(hmac_t));
+    zip_wipe(&zip->aes, sizeof(aes_t));
+    zip_wipe(zip->pad, sizeof(zip->pad));
     int bad = zip->bad;
     zip->id = 0;
-    free(zip);
+    mem_t mem = zip->mem;
+    mem_free(&mem, zip, sizeof(zip_t));
     return bad;
 }
 
+// Macros for reading little-endian integers from a byte buffer.
+#define GET2(p) ((p)[0] + ((unsigned)(p)[1] << 8))
+#define GET4(p) (GET2(p) + ((uint32_t)GET2((p) + 2) << 16))
+#define GET8(p) (GET4(p) + ((uint64_t)GET4((p) + 4) << 32))
+
+// Fill in head from the central directory header at central and its extra
+// field of length xlen at extra. The name has already been saved in head. The
+// general purpose bit flags and version needed to extract are kept, so that
+// entries from other zippers, e.g. with traditional encryption or other
+// compression methods, are described as they were. Return 0 on success, or 1
+// if the compression method does not fit in head.
+static int zip_old(head_t *head, unsigned char const *central,
+                   unsigned char const *extra, size_t xlen) {
+    unsigned method = GET2(central + 10);
+    head->os = central[5];
+    head->lock = method == 99;
+    if (head->lock)
+        method = 8;                 // until the AES extra field says otherwise
+    head->desc = (GET2(central + 8) >> 3) & 1;
+    head->flags = GET2(central + 8) & ~(8 + head->lock);
+    head->need = GET2(central + 6);
+    if (head->need == 0)
+        head->need = 10;            // (not valid, but it marks an old entry)
+    head->crc = GET4(central + 16);
+    head->clen = GET4(central + 20);
+    head->ulen = GET4(central + 24);
+    head->mode = GET4(central + 38);
+    head->off = GET4(central + 42);
+
+    // Get the zip64 lengths and offset, the AES method, and the timestamps
+    // from the extra field, as written by zip_central().
+    int stamp = 0;
+    unsigned char const *end = extra + xlen;
+    while (end - extra >= 4) {
+        unsigned id = GET2(extra), len = GET2(extra + 2);
+        unsigned char const *x = extra + 4;
+        if (len > end - x)
+            break;
+        extra = x + len;
+        if (id == 1) {
+            if (head->ulen == MAX32 && extra - x >= 8) {
+                head->ulen = GET8(x);
+                x += 8;
+            }
+            if (head->clen == MAX32 && extra - x >= 8) {
+                head->clen = GET8(x);
+                x += 8;
+            }
+            if (head->off == MAX32 && extra - x >= 8)
+                head->off = GET8(x);
+        }
+        else if (id == 0x9901 && len >= 7 && head->lock)
+            method = GET2(x + 5);
+        else if (id == 13 && len >= 8 && head->os == 3) {
+            head->atime = GET4(x);
+            head->mtime = GET4(x + 4);
+            head->ctime = 0;
+            stamp = 1;
+        }
+        else if (id == 0x5455 && len >= 5 && (x[0] & 1) && head->os == 3 &&
+                 !stamp) {                  // Info-ZIP, modified time only
+            head->mtime = head->atime = (uint32_t)GET4(x + 1);
+            head->ctime = 0;
+            stamp = 1;
+        }
+        else if (id == 10 && len >= 32 && head->os == 10 &&
+                 GET2(x + 4) == 1 && GET2(x + 6) >= 24) {
+            head->mtime = GET8(x + 8);
+            head->atime = GET8(x + 16);
+            head->ctime = GET8(x + 24);
+            stamp = 1;
+        }
+    }
+
+    // Without a timestamp extra field, as from another zipper, make it a Unix
+    // entry with the DOS time.
+    if (!stamp) {
+        unsigned time = GET2(central + 12), date = GET2(central + 14);
+        struct tm tm = {0};
+        tm.tm_year = (date >> 9) + 80;
+        tm.tm_mon = ((date >> 5) & 0xf) - 1;
+        tm.tm_mday = date & 0x1f;
+        tm.tm_hour = time >> 11;
+        tm.tm_min = (time >> 5) & 0x3f;
+        tm.tm_sec = (time & 0x1f) << 1;
+        tm.tm_isdst = -1;
+        time_t clock = mktime(&tm);
+        if ((head->mode >> 16) == 0)
+            head->mode |= 0100644 << 16;    // no Unix permissions
+        head->os = 3;
+        head->mtime = head->atime = clock < 0 ? 0 : (uint64_t)clock;
+        head->ctime = 0;
+    }
+    head->method = method;
+    return method != head->method;
+}
+
+// Load the central directory of the zip file in zip->out into the list of
+// headers, and truncate the zip file at the start of the central directory,
+// leaving zip->out positioned there to write new entries. Return 0 on
+// success, or 1 if the zip file could not be read or truncated, or its end
+// records or central directory are not valid.
+static int zip_load(zip_t *zip) {
+    FILE *in = zip->out;
+    if (fseeko(in, 0, SEEK_END))
+        return 1;
+    int64_t size = ftello(in);
+    if (size <= 0)
+        return size < 0;            // empty file: start a new zip file
+
+    // Read the end of the file, which holds the end record, a possible
+    // comment, and a possible zip64 end record and locator before that.
+    size_t got = size < 76 + 22 + MAX16 ? (size_t)size : 76 + 22 + MAX16;
+    unsigned char *buf = zip_alloc(zip, got);
+    int bad = fseeko(in, size - got, SEEK_SET) ||
+              fread(buf, 1, got, in) != got;
+
+    // Find the end record, searching back over a possible comment.
+    size_t end = got < 22 ? 0 : got - 22 + 1;
+    do {
+        if (bad || end-- == 0) {
+            zip_free(zip, buf, got);
+            return 1;
+        }
+    } while (GET4(buf + end) != 0x06054b50 ||
+             end + 22 + GET2(buf + end + 20) != got);
+    uint64_t num = GET2(buf + end + 10);
+    uint64_t len = GET4(buf + end + 12);
+    uint64_t beg = GET4(buf + end + 16);
+    uint64_t at = size - got + end;
+    int64_t loc = end >= 20 && GET4(buf + end - 20) == 0x07064b50 ?
+                  (int64_t)GET8(buf + end - 12) : -1;
+    zip_free(zip, buf, got);
+
+    // Use the zip64 end record if there is a locator. Look for the record at
+    // the offset in the locator, which is right if there is nothing before the
+    // zip file. Otherwise look just before the locator, where it is if it has
+    // no extensible data, as zipflow writes it.
+    if (loc != -1) {
+        unsigned char xend[56];
+        int64_t pos[2] = {loc, (int64_t)at - 76};
+        int i;
+        for (i = 0; i < 2; i++)
+            if (pos[i] >= 0 && (uint64_t)pos[i] + 76 <= at &&
+                fseeko(in, pos[i], SEEK_SET) == 0 &&
+                fread(xend, 1, 56, in) == 56 &&
+                GET4(xend) == 0x06064b50 &&
+                (uint64_t)pos[i] + 12 + GET8(xend + 4) + 20 <= at)
+                break;
+        if (i == 2)
+            return 1;
+        at = pos[i];
+        num = GET8(xend + 32);
+        len = GET8(xend + 40);
+        beg = GET8(xend + 48);
+    }
+
+    // Locate the zip file in the file from where the central directory is, in
+    // case there is something before it.
+    if (len > at || beg > at - len)
+        return 1;
+    int64_t base = at - len - beg;
+
+    // Read the central directory headers into the list of headers.
+    if (fseeko(in, base + beg, SEEK_SET))
+        return 1;
+    uint64_t left = len;
+    while (num) {
+        unsigned char central[46];
+        if (left < 46 || fread(central, 1, 46, in) != 46 ||
+            GET4(central) != 0x02014b50)
+            return 1;
+        size_t nlen = GET2(central + 28), xlen = GET2(central + 30),
+               clen = GET2(central + 32);
+        if (left - 46 < nlen + xlen + clen)
+            return 1;
+        left -= 46 + nlen + xlen + clen;
+        zip_next(zip);
+        head_t *head = zip->head + zip->hnum;
+        head->name = zip_alloc(zip, nlen + 1);
+        head->nlen = nlen;
+        size_t xget = xlen > CHUNK ? CHUNK : xlen;
+        if (fread(head->name, 1, nlen, in) != nlen ||
+            fread(zip->comp, 1, xget, in) != xget ||
+            (xlen + clen > xget &&
+             fseeko(in, xlen + clen - xget, SEEK_CUR))) {
+            zip_free(zip, head->name, nlen + 1);
+            return 1;
+        }
+        head->name[nlen] = 0;
+        if (zip_old(head, central, zip->comp, xget)) {
+            zip_free(zip, head->name, nlen + 1);
+            return 1;
+        }
+        zip_held(zip, nlen + 1, 0);
+        zip->hnum++;
+        num--;
+    }
+    if (left)
+        return 1;
+
+    // Write new entries over the central directory.
+    if (fseeko(in, base + beg, SEEK_SET) || fflush(in))
+        return 1;
+#ifdef _WIN32
+    if (_chsize_s(_fileno(in), base + beg))
+#else
+    if (ftruncate(fileno(in), base + beg))
+#endif
+        return 1;
+    zip->off = beg;
+    zip->old = beg;
+    return 0;
+}
+
 // ------ exposed functions ------
 
+// See comments in zipflow.h.
+void zip_memory(void *opaque, void *(*alloc)(void *, size_t),
+                void (*free)(void *, void *, size_t)) {
+    zip_mem.opaque = opaque;
+    zip_mem.alloc = free == NULL ? NULL : alloc;
+    zip_mem.free = alloc == NULL ? NULL : free;
+}
+
 // See comments in zipflow.h.
 ZIP *zip_open(FILE *out, int level) {
     if (out == NULL || level < -1 || level > Z_BEST_COMPRESSION)
@@ -697,6 +2186,21 @@ ZIP *zip_pipe(void *handle, int (*put)(void *, void const *, size_t),
     return (ZIP *)zip;
 }
 
+// See comments in zipflow.h.
+ZIP *zip_append(FILE *out, int level) {
+    if (out == NULL || level < -1 || level > Z_BEST_COMPRESSION)
+        return NULL;
+    zip_t *zip = zip_init(level);
+    zip->out = out;
+    zip->handle = zip;
+    zip->put = zip_write;
+    if (zip_load(zip)) {
+        zip_clean(zip);
+        return NULL;
+    }
+    return (ZIP *)zip;
+}
+
 // See comments in zipflow.h.
 int zip_log(ZIP *ptr, void *hook, void (*log)(void *, char *)) {
     zip_t *zip = (zip_t *)ptr;
@@ -707,6 +2211,59 @@ int zip_log(ZIP *ptr, void *hook, void (*log)(void *, char *)) {
     return 0;
 }
 
+// See comments in zipflow.h.
+int zip_diag(ZIP *ptr, void *hook,
+             void (*diag)(void *, int, int, char const *)) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID)
+        return -1;
+    zip->dhook = hook;
+    zip->diag = diag;
+    return 0;
+}
+
+// See comments in zipflow.h.
+char const *zip_reason(int code) {
+    static char const *reason[ZIP_DIAGS] = {
+        "could not open for reading -- skipping",
+        "read error -- entry omitted",
+        "could not get metadata -- skipping",
+        "could not open directory -- skipping",
+        "not a file or directory -- skipping",
+        "file name is too long for the zip format -- skipping",
+        "write error -- aborting",
+        "length or CRC-32 does not match zip_known() -- entry omitted"
+    };
+    return code < 0 || code >= ZIP_DIAGS ? NULL : reason[code];
+}
+
+// See comments in zipflow.h.
+int zip_fixed(ZIP *ptr, int64_t epoch, int pin) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->off != zip->old || zip->feed ||
+        (pin && epoch < 0))
+        return -1;
+    zip->fixed = 1;
+    zip->epoch = epoch < 0 ? -1 : epoch;
+    zip->pinned = pin != 0;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_seek(ZIP *ptr) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->out == NULL ||
+        zip->off != zip->old || zip->feed)
+        return -1;
+    int64_t base = ftello(zip->out);
+    if (base < 0 || fseeko(zip->out, base, SEEK_SET))
+        return 1;                   // not seekable
+    zip->base = base - zip->off;
+    zip->seek = 1;
+    zip->whole = 0;                 // local headers will be rewritten
+    return 0;
+}
+
 // See comments in zipflow.h.
 int zip_entry(ZIP *ptr, char const *path) {
     zip_t *zip = (zip_t *)ptr;
@@ -720,6 +2277,41 @@ int zip_entry(ZIP *ptr, char const *path) {
     return zip->bad;
 }
 
+// See comments in zipflow.h.
+int zip_size(ZIP *ptr, char const *path, uint64_t *bytes, uint64_t *files) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || path == NULL || zip->feed ||
+        bytes == NULL || files == NULL)
+        return -1;
+    size_t len = strlen(path);
+    zip_room(zip, len + 1);
+    memcpy(zip->path, path, len + 1);
+    zip->plen = len;
+    uint64_t sizes[2] = {*bytes, *files};
+    zip->sizes = sizes;
+    zip_scan(zip);
+    zip->sizes = NULL;
+    *bytes = sizes[0];
+    *files = sizes[1];
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_progress(ZIP *ptr, void *hook,
+                 void (*progress)(void *, char const *, uint64_t, uint64_t),
+                 uint64_t bytes, uint64_t msec) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID)
+        return -1;
+    zip->phook = hook;
+    zip->progress = progress;
+    zip->pbytes = bytes;
+    zip->pns = msec > UINT64_MAX / 1000000 ? UINT64_MAX : msec * 1000000;
+    zip->pin = zip->all.ulen;
+    zip->ptime = zip_clock();
+    return 0;
+}
+
 // See comments in zipflow.h.
 int zip_meta(ZIP *ptr, char const *path, int os, ...) {
     zip_t *zip = (zip_t *)ptr;
@@ -736,10 +2328,16 @@ int zip_meta(ZIP *ptr, char const *path, int os, ...) {
     // Save the path name for the header.
     zip_next(zip);
     head_t *head = zip->head + zip->hnum;
-    head->name = malloc(len + 1);
-    assert(head->name != NULL && "out of memory");
+    zip_fold(zip);
+    head->name = zip_alloc(zip, len + 1);
+    zip_held(zip, len + 1, 0);
     memcpy(head->name, path, len + 1);
     head->nlen = len;
+    head->lock = zip->crypt;
+    head->method = zip->seek && zip->level == 0 ? 0 : 8;
+    head->desc = !zip->seek;
+    head->flags = 0x800 + LEVEL();
+    head->need = 0;
 
     // Save provided OS-specific (Unix) header information.
     head->os = os;
@@ -758,74 +2356,280 @@ int zip_meta(ZIP *ptr, char const *path, int os, ...) {
         head->mtime = va_arg(args, uint64_t);
     }
     va_end(args);
+    zip_norm(zip, head);
 
     // Set up for writing the entry with zip_data().
     head->off = zip->off;
     head->ulen = 0;
     head->clen = 0;
     head->crc = crc32(0, Z_NULL, 0);
+    zip->rhash = 0;
+    zip->fed = 0;
+    zip->mark = zip->span;
+    zip->hashed = zip->digest != NULL;
+    if (zip->hashed)
+        sha_init(&zip->esha);
     zip->feed = 1;
     return 0;
 }
 
+// Write the len bytes at data as the stored data of an entry whose length and
+// CRC-32 were provided by zip_known(), already written in the local header.
+// Complete the entry if last is true. If the data is short, or its CRC-32 does
+// not match when verifying, the entry is padded out to the declared length to
+// keep the zip file readable, and omitted from the central directory.
+static int zip_exact(zip_t *zip, head_t *head, void const *data, size_t len,
+                     int last) {
+    if (len) {
+        uint64_t start = zip_clock();
+        if (zip->verify)
+            zip->check = crc32_z(zip->check, data, len);
+        uint64_t now = zip_clock();
+        zip->one.crc_ns += now - start;
+        if (zip->hashed) {
+            sha_update(&zip->esha, data, len);
+            zip->one.hash_ns += zip_clock() - now;
+        }
+        head->ulen += len;
+        zip_store(zip, head, data, len);
+        if (zip->bad)
+            return zip->bad;
+    }
+
+    if (last) {
+        // Complete the entry and terminate feed mode.
+        if (head->ulen < zip->size ||
+            (zip->verify && zip->check != head->crc)) {
+            warn(ZIP_KNOWN, 0, "%s of %s does not match zip_known() -- "
+                 "entry omitted",
+                 head->ulen < zip->size ? "length" : "CRC-32", head->name);
+            zip->omit = 1;
+            memset(zip->comp, 0, CHUNK);
+            while (head->ulen < zip->size && !zip->bad) {
+                uint64_t left = zip->size - head->ulen;
+                size_t n = left < CHUNK ? (size_t)left : CHUNK;
+                head->ulen += n;
+                zip_store(zip, head, zip->comp, n);
+                if (head->lock)
+                    memset(zip->comp, 0, n);
+            }
+        }
+        zip_desc(zip);
+        zip_tally(zip);
+        zip_keep(zip);
+        zip->known = 0;
+        zip->feed = 0;
+    }
+    return zip->bad;
+}
+
 // See comments in zipflow.h.
 int zip_data(ZIP *ptr, void const *data, size_t len, int last) {
     zip_t *zip = (zip_t *)ptr;
     if (zip == NULL || zip->id != ID || zip->feed == 0 ||
         (data == NULL && len != 0))
         return -1;
+    if (zip->known && len > zip->size - zip->head[zip->hnum].ulen)
+        return -1;                  // more data than declared by zip_known()
     if (len == 0 && last == 0)
         // Nothing to do.
         return zip->bad;
 
     if (zip->feed == 1) {
         // Write local header once before any compressed data.
+        probe(entry__start, zip->head[zip->hnum].name, zip->level);
         zip_local(zip);
         zip->feed = 2;
     }
 
-    // Update the CRC-32 and uncompressed length.
     head_t *head = zip->head + zip->hnum;
+    if (zip->known)
+        return zip_exact(zip, head, data, len, last);
+
+    // Update the CRC-32 and uncompressed length.
     if (len) {
+        uint64_t start = zip_clock();
         head->crc = crc32_z(head->crc, data, len);
+        uint64_t now = zip_clock();
+        zip->one.crc_ns += now - start;
+        if (zip->hashed) {
+            sha_update(&zip->esha, data, len);
+            zip->one.hash_ns += zip_clock() - now;
+        }
         head->ulen += len;
     }
 
     // Compress the data to the output stream, updating the compressed length.
-    zip->strm.avail_in = 0;
-    zip->strm.next_in = (unsigned char *)(uintptr_t)data;   // awful hack
-    int ret;
-    do {
-        unsigned more = UINT_MAX - zip->strm.avail_in;
-        if (more > len)
-            more = (unsigned)len;
-        zip->strm.avail_in += more;
-        len -= more;
-        zip->strm.avail_out = CHUNK;
-        zip->strm.next_out = zip->comp;
-        ret = deflate(&zip->strm, last && len == 0 ? Z_FINISH : Z_NO_FLUSH);
-        zip_put(zip, zip->comp, CHUNK - zip->strm.avail_out);
-        if (zip->bad)
-            return zip->bad;            // abandon compression on write error
-        head->clen += CHUNK - zip->strm.avail_out;
-        // Continue until all input consumed and all output delivered. If last
-        // is false, this loop will exit after a final unproductive call of
-        // deflate(), which returns Z_BUF_ERROR.
-    } while (ret == Z_OK);
+    // deflate() can only take up to UINT_MAX bytes at a time. A stored entry
+    // is copied as is.
+    int ret = Z_STREAM_END;
+    if (head->method == 0)
+        zip_store(zip, head, data, len);
+    else {
+        zip->strm.next_in = (unsigned char *)(uintptr_t)data;   // awful hack
+        do {
+            unsigned more = len > UINT_MAX ? UINT_MAX : (unsigned)len;
+            zip->strm.avail_in = more;
+            len -= more;
+            ret = zip_sync(zip, head,
+                           last && len == 0 ? Z_FINISH : Z_NO_FLUSH);
+            if (zip->bad)
+                break;
+            assert(zip->strm.avail_in == 0 && "internal error");
+        } while (len);
+    }
+    if (zip->bad)
+        return zip->bad;            // abandon compression on write error
 
     if (last) {
         // Complete the zip file entry and terminate feed mode.
         assert(ret == Z_STREAM_END && "internal error");
-        deflateReset(&zip->strm);       // prepare for next use of engine
+        if (head->method)
+            deflateReset(&zip->strm);   // prepare for next use of engine
         zip_desc(zip);
+        zip_tally(zip);
         zip->hnum++;
         zip->feed = 0;
     }
-    else
-        assert(ret == Z_BUF_ERROR && "internal error");
     return zip->bad;
 }
 
+// See comments in zipflow.h.
+int zip_known(ZIP *ptr, uint64_t ulen, uint32_t crc, int verify) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed != 1)
+        return -1;
+    head_t *head = zip->head + zip->hnum;
+    head->method = 0;
+    head->desc = 0;
+    head->crc = crc;
+    zip->known = 1;
+    zip->verify = verify != 0;
+    zip->size = ulen;
+    zip->check = crc32(0, Z_NULL, 0);
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_raw(ZIP *ptr, void const *comp, size_t clen,
+            uint64_t ulen, uint32_t crc) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed != 1 || zip->known ||
+        comp == NULL || clen == 0)
+        return -1;                  // a deflate stream is at least 2 bytes
+
+    // Write the local header, the provided compressed data, and the data
+    // descriptor, and update the entry count.
+    head_t *head = zip->head + zip->hnum;
+    head->method = 8;
+    head->ulen = ulen;
+    head->clen = 0;
+    head->crc = crc;
+    zip->hashed = 0;                // no uncompressed data to hash
+    probe(entry__start, head->name, zip->level);
+    zip_local(zip);
+    zip_store(zip, head, comp, clen);
+    zip_desc(zip);
+    zip_tally(zip);
+    zip->hnum++;
+    zip->feed = 0;
+    return zip->bad;
+}
+
+// See comments in zipflow.h.
+int zip_encrypt(ZIP *ptr, char const *password) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed)
+        return -1;
+    if (password == NULL) {
+        zip->crypt = 0;
+        return 0;
+    }
+    if (zip_random(zip->seed, sizeof(zip->seed)))
+        return -1;
+    hmac_key(&zip->pass, (unsigned char const *)password, strlen(password));
+    zip->crypt = 1;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_points(ZIP *ptr, uint64_t span) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed || (span && span < 65536))
+        return -1;
+    zip->span = span;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_align(ZIP *ptr, unsigned align) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed == 2 ||
+        align > 32768 || (align & (align - 1)))
+        return -1;
+    zip->align = align > 1 ? align : 0;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_rsync(ZIP *ptr, int bits) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed ||
+        (bits != 0 && (bits < 8 || bits > 24)))
+        return -1;
+    zip->rbits = bits;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_digest(ZIP *ptr, void *hook,
+               void (*digest)(void *, char const *, unsigned char const *)) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || zip->feed)
+        return -1;
+    zip->shook = hook;
+    zip->digest = digest;
+    zip->whole = digest != NULL && zip->off == 0 && !zip->seek;
+    if (zip->whole)
+        sha_init(&zip->zsha);
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_index(ZIP *ptr, void *handle,
+              int (*put)(void *, void const *, size_t)) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || put == NULL || zip->off != 0 ||
+        zip->feed || zip->iput != NULL)
+        return -1;
+    zip->ihandle = handle;
+    zip->iput = put;
+    unsigned char head[8] = {'Z', 'F', 'I', 'X', 1};    // magic, version
+    zip_iput(zip, head, sizeof(head));
+    return zip->bad;
+}
+
+// See comments in zipflow.h.
+int zip_track(ZIP *ptr, void *hook,
+              void (*track)(void *, char const *, zip_stats_t const *)) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID)
+        return -1;
+    zip->thook = hook;
+    zip->track = track;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_stats(ZIP *ptr, zip_stats_t *stats) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID || stats == NULL)
+        return -1;
+    *stats = zip->all;
+    stats_add(stats, &zip->one);
+    return 0;
+}
+
 // See comments in zipflow.h.
 int zip_close(ZIP *ptr) {
     zip_t *zip = (zip_t *)ptr;
@@ -837,9 +2641,25 @@ int zip_close(ZIP *ptr) {
 
     // Write the trailing metadata and flush the output stream.
     uint64_t beg = zip->off;
+    probe(central__start, zip->hnum, beg);
     for (size_t i = 0; i < zip->hnum && !zip->bad; i++)
         zip_central(zip, zip->head + i);
     zip_end(zip, beg);
+    probe(central__done, zip->hnum, zip->off - beg);
+    if (zip->iput != NULL && !zip->bad) {
+        unsigned char rec[32] = {3};    // end record type
+        PUT4(rec + 4, sizeof(rec)); // record length
+        PUT8(rec + 8, zip->hnum);   // number of entries
+        PUT8(rec + 16, beg);        // central directory offset
+        PUT8(rec + 24, zip->off - beg); // length of directory and end records
+        zip_iput(zip, rec, sizeof(rec));
+        zip_iput(zip, NULL, 0);
+    }
+    if (zip->whole && zip->digest != NULL && !zip->bad) {
+        unsigned char sum[32];
+        sha_final(&zip->zsha, sum);
+        zip->digest(zip->shook, NULL, sum);
+    }
     if (!zip->bad)
         zip->put(zip->handle, NULL, 0);
     return zip_clean(zip);
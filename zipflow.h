@@ -108,8 +108,16 @@
 // in the resulting zip file. The small constant is 64 to 72 bytes plus the
 // null termination and allocation overhead for the file name.
 
+#ifndef ZIPFLOW_H
+#define ZIPFLOW_H
+
 #include <stdio.h>
 #include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef void ZIP;           // opaque structure for zip streaming operations
 
 // Return the zip state to write a zip file to out. If out is file, it is
@@ -131,6 +139,44 @@ ZIP *zip_pipe(void *handle,
               int (*put)(void *handle, void const *ptr, size_t len),
               int level);
 
+// Like zip_open(), but add entries to the existing zip file in out, which must
+// be open for reading and writing in binary mode, such as with "r+b". The
+// central directory is loaded into memory, the zip file is truncated at the
+// start of the central directory, and new entries are written from there.
+// zip_close() then writes a central directory with the old and new entries.
+// Only the central directory is read, so the cost is proportional to its size
+// plus the new data, not to the size of the zip file. The zip file is not
+// valid again until zip_close() completes. The metadata of the old entries is
+// kept as written by zipflow, including zip64 lengths and offsets, timestamps,
+// and encryption. The compression method, general purpose bit flags, and
+// version needed to extract of entries from other zippers are kept, so that
+// their data can still be extracted, but their other extra fields and comments
+// are dropped. The DOS times in the central directory are recomputed, so
+// zip_fixed() should be called if it was used to make the zip file.
+// zip_index() and the zip file digest from zip_digest() are not available,
+// since the old entries are not rewritten. If out is empty, then this is the
+// same as zip_open(). NULL is returned if out is NULL, level is out of range,
+// or out could not be read or truncated, or is not a valid zip file, or it has
+// an entry with a compression method number greater than 255.
+ZIP *zip_append(FILE *out, int level);
+
+// If the out given to zip_open() is seekable, such as a regular file, then
+// complete each local header in place after its entry's data is written,
+// instead of following the data with a data descriptor. Readers that use only
+// the local headers can then find the lengths and CRC-32 there. When seeking,
+// level 0 stores the entries with no compression, instead of as deflate stored
+// blocks. A stored entry has 20 bytes reserved in its local header for 64-bit
+// lengths, so that its end can always be found from the local header. A
+// deflated entry has no such room, so it is 16 bytes smaller without the data
+// descriptor, but if its lengths turn out to need 64 bits, then it still gets
+// a data descriptor. Since the local headers are rewritten, the zip file
+// digest from zip_digest() is not available when seeking. zip_seek() can only
+// be called before anything is written. On success, 0 is returned. If out is
+// not seekable, then 1 is returned, and the zip file is streamed as usual. If
+// zip is not valid or not from zip_open() or zip_append(), or something has
+// already been written, then -1 is returned.
+int zip_seek(ZIP *zip);
+
 // Register the function log() to intercept warning and error messages. msg is
 // an allocated zero-terminated string containing the message. The user is
 // responsible for freeing the allocation. hook is passed to the log() function
@@ -143,6 +189,57 @@ ZIP *zip_pipe(void *handle,
 // is returned.
 int zip_log(ZIP *zip, void *hook, void (*log)(void *hook, char *msg));
 
+// Diagnostic codes for zip_diag(), and indices of the diag[] counts in the
+// statistics from zip_stats().
+enum {
+    ZIP_OPEN,       // could not open a file for reading -- skipped
+    ZIP_READ,       // read error on a file -- entry omitted from directory
+    ZIP_STAT,       // could not get a file's metadata -- skipped
+    ZIP_DIR,        // could not open a directory -- skipped
+    ZIP_TYPE,       // not a regular file or directory -- skipped
+    ZIP_LONG,       // file name too long for the zip format -- skipped
+    ZIP_WRITE,      // write error on the output -- aborted
+    ZIP_KNOWN,      // data does not match zip_known() -- entry omitted
+    ZIP_DIAGS       // (number of diagnostic codes)
+};
+
+// Register the function diag() to receive warnings and errors as structured
+// diagnostics instead of messages. No message is formatted or allocated.
+// code is one of the codes above, err is the errno value (or the
+// GetLastError() value for the Windows directory traversal), or 0 if not
+// applicable, and path is the name of the file or directory concerned, the
+// entry name for ZIP_KNOWN, or NULL for ZIP_WRITE. path is only valid during
+// the call, and must be copied if it is to be retained. hook is passed to
+// diag() on each call. While diag() is registered, log() is not called and
+// nothing is written to stderr. The previous diag() function can be
+// unregistered by passing NULL for the function pointer, restoring the log()
+// or stderr messages. The diagnostics are counted by code in the statistics
+// from zip_stats() in either case. On success, 0 is returned. If zip is not
+// valid, then -1 is returned.
+int zip_diag(ZIP *zip, void *hook,
+             void (*diag)(void *hook, int code, int err, char const *path));
+
+// Return a short constant description of the diagnostic code, or NULL if code
+// is not valid. This can be used with strerror(err) to make a message from a
+// diagnostic when desired.
+char const *zip_reason(int code);
+
+// Make the zip file reproducible, so that the same files and metadata always
+// result in the same bytes, regardless of directory order, time zone, or
+// system. Directories are traversed in sorted order of the names' bytes. DOS
+// times are in UTC, and the current time is never used. Windows metadata and
+// separators are converted to Unix, with no creation time. The permissions
+// are reduced to 0644, or 0755 if executable by anyone. The access time is
+// set to the modified time. If epoch is not negative, then times later than
+// epoch (seconds since 1970) are replaced with epoch, as for the
+// SOURCE_DATE_EPOCH convention, or if pin is true, all times are set to epoch.
+// The compression level and the zlib version must also be the same to get the
+// same bytes. This applies to entries from both zip_entry() and zip_meta(),
+// and must be called before any entries are written. On success, 0 is
+// returned. If zip is not valid, entries have been written, or pin is true
+// with a negative epoch, then -1 is returned.
+int zip_fixed(ZIP *zip, int64_t epoch, int pin);
+
 // Add an entry to the zip file with the file path, or entries to the zip file
 // with any files contained at any level in the directory path. On success, 0
 // is returned. If zip is not valid, then -1 is returned. If there is a write
@@ -150,14 +247,25 @@ int zip_log(ZIP *zip, void *hook, void (*log)(void *hook, char *msg));
 // attempted on this stream, and the only viable action is zip_close().
 int zip_entry(ZIP *zip, char const *path);
 
+// Add the total size in bytes of the file path, or of all of the files
+// contained at any level in the directory path, to *bytes, and add the number
+// of those files to *files. These are the files that zip_entry() would zip, so
+// that a total is available for the progress() function registered by
+// zip_progress(). Only the metadata is read, and no warnings are issued. The
+// files could change before they are zipped, so the total is an estimate. On
+// success, 0 is returned. If zip, path, bytes, or files are not valid, then -1
+// is returned.
+int zip_size(ZIP *zip, char const *path, uint64_t *bytes, uint64_t *files);
+
 // Prepare to write a new zip entry by providing the metadata for the entry:
 // the name path and the operating system os, followed by operating-system
 // specific parameters. path is limited by the zip format to no more than 65535
 // bytes in length. os must be 3 for Unix attributes, or 10 for Windows
 // attributes. See the commented prototypes below for the types. The next call
-// must be zip_data() to write the entry data. On success, 0 is returned. If
-// zip, path, or os are invalid, -1 is returned. Nothing is written to the zip
-// file by this function, so there is no possibility of a new write error.
+// must be zip_data(), zip_known(), or zip_raw() to write the entry data. On
+// success, 0 is returned. If zip, path, or os are invalid, -1 is returned.
+// Nothing is written to the zip file by this function, so there is no
+// possibility of a new write error.
 int zip_meta(ZIP *zip, char const *path, int os, ...);
 // Unix:
 //      int zip_meta(ZIP *zip, char const *path, 3, unsigned mode,
@@ -173,6 +281,224 @@ int zip_meta(ZIP *zip, char const *path, int os, ...);
 // returned.
 int zip_data(ZIP *zip, void const *data, size_t len, int last);
 
+// Declare that the data for the entry whose metadata was just provided by
+// zip_meta() is exactly ulen bytes with CRC-32 crc. The entry is then stored
+// instead of compressed, so that its lengths and CRC-32 can be written in the
+// local header, with no data descriptor following the data. Some readers, and
+// anything that seeks to entries using only the local headers, need that. The
+// data is then provided with zip_data() as usual. A zip_data() call that would
+// exceed ulen bytes in total returns -1 and writes nothing. If verify is true,
+// then the CRC-32 of the data is computed and checked against crc. If the data
+// ends short of ulen bytes, or its CRC-32 does not match when verifying, then
+// the entry is padded with zeros to ulen bytes, a ZIP_KNOWN diagnostic is
+// issued, and the entry is omitted from the central directory. zip_known() can
+// only be called immediately after zip_meta(). On success, 0 is returned. If
+// zip is invalid, -1 is returned.
+int zip_known(ZIP *zip, uint64_t ulen, uint32_t crc, int verify);
+
+// Write the clen bytes at comp, which must be a complete raw deflate stream
+// (zlib windowBits -15, ended with Z_FINISH), as the data for the entry whose
+// metadata was just provided by zip_meta(). ulen is the length of the
+// uncompressed data, and crc is its CRC-32. This completes the entry. The
+// deflate stream and CRC are not checked, though an empty stream, with clen
+// zero, is rejected. Even empty data has a deflate stream of at least two
+// bytes. zip_raw() can only be called immediately after zip_meta(). On
+// success, 0 is returned. If zip or comp is invalid, or clen is zero, then -1
+// is returned. If there is a write error, 1 is returned.
+//
+// A ZIP * must only be used by one thread at a time. zip_raw() permits many
+// threads to feed one zip file, by compressing their entries in parallel with
+// their own deflate engines, and then handing the results to the single
+// thread that owns the ZIP *, or by serializing just the zip_meta() and
+// zip_raw() calls with a mutex. Only the copying of the compressed data to the
+// output is then serialized.
+int zip_raw(ZIP *zip, void const *comp, size_t clen,
+            uint64_t ulen, uint32_t crc);
+
+// Register the function progress() to report the progress of the zip stream.
+// name is the name of the entry being written, in is the total number of
+// uncompressed bytes processed so far for all entries, and out is the number
+// of bytes of zip file written so far. progress() is called when at least
+// bytes more input bytes have been processed, or at least msec milliseconds
+// have passed, since the last call, checked after each chunk of compressed
+// output. It is also called when each entry is completed. Use UINT64_MAX for
+// bytes or msec to disable that criterion. progress() may block, e.g. to
+// throttle the stream. hook is passed to progress() on each call. The previous
+// progress() function can be unregistered by passing NULL for the function
+// pointer. On success, 0 is returned. If zip is not valid, then -1 is
+// returned.
+int zip_progress(ZIP *zip, void *hook,
+                 void (*progress)(void *hook, char const *name,
+                                  uint64_t in, uint64_t out),
+                 uint64_t bytes, uint64_t msec);
+
+// Register the function digest() to receive SHA-256 digests, computed in the
+// same pass as the CRC-32s, so that the input and the zip file need not be
+// read again to make a manifest. When each entry is completed, digest() is
+// called with the entry name and the 32-byte digest of its uncompressed data,
+// or NULL in place of the digest for an entry from zip_raw(), whose
+// uncompressed data is not seen. Entries omitted from the central directory
+// are not reported. If digest() is registered before anything is written,
+// then when the zip file is complete, before the final flush, digest() is
+// called with a NULL name and the digest of the entire zip file, unless
+// zip_seek() is in effect. hook is passed to digest() on each call. The time
+// spent is reported in the hash_ns statistic. This cannot be called during an
+// entry's zip_data() calls. The previous digest() function can be
+// unregistered by passing NULL for the function pointer. On success, 0 is
+// returned. If zip is not valid, then -1 is returned.
+int zip_digest(ZIP *zip, void *hook,
+               void (*digest)(void *hook, char const *name,
+                              unsigned char const *sha256));
+
+// Encrypt the subsequent entries with password, using WinZip AES-256 (AE-2),
+// which is decrypted by 7-Zip, WinZip, and other unzippers that support AES.
+// Each entry has a random salt, from which its keys are derived using PBKDF2
+// with HMAC-SHA1 and 1000 iterations. The compressed data is encrypted in the
+// output path with AES in CTR mode, and authenticated with HMAC-SHA1. The
+// password's HMAC state is computed here once, and only the salt is hashed for
+// each entry, but the key derivation still takes around a millisecond per
+// entry. If zipflow.c is compiled for x86 with AES-NI enabled, e.g. with -maes
+// or -march=native, then AES-NI is used. Otherwise a portable table-driven AES
+// is used, whose timing depends on the data. The names and metadata are not
+// encrypted, and since the salts are random, a zip file with encrypted entries
+// is not reproducible. A NULL password stops encrypting the subsequent
+// entries. This cannot be called during an entry's zip_data() calls. The time
+// spent is reported in the crypt_ns statistic. On success, 0 is returned. If
+// zip is not valid, or the system has no secure random source, then -1 is
+// returned.
+int zip_encrypt(ZIP *zip, char const *password);
+
+// Make the compressed data rsyncable, for backup and deduplication systems
+// that find content-defined chunks. A rolling hash of the last bits bytes of
+// the input, as for gzip --rsyncable, triggers a full flush of deflate at
+// content-defined points in the input, on average every 2^bits bytes. The
+// compressed data after each such point depends only on the input that
+// follows, so a local change in the input changes only the nearby compressed
+// data. This costs about five bytes per flush, and the loss of the history
+// for matches at each flush. The number of flushes is reported in the syncs
+// statistic. bits must be in 8..24, or 0 to disable. 12 is a common choice.
+// This applies to the subsequent entries, and cannot be called during an
+// entry's zip_data() calls. On success, 0 is returned. If zip or bits is not
+// valid, then -1 is returned.
+int zip_rsync(ZIP *zip, int bits);
+
+// Align the data of the subsequent stored entries to align bytes from the
+// start of the zip file, so that a reader can map the zip file into memory
+// and use a stored entry's data in place, e.g. on page boundaries with align
+// 4096. The local header is padded with an Android zipalign extra field to do
+// that. Stored entries are those from zip_known(), and at level 0 when
+// zip_seek() is in effect. Encrypted entries are not aligned. align must be a
+// power of two no more than 32768, or 0 or 1 to not align. This can be called
+// after zip_meta() and before its zip_data() calls to set the alignment for
+// that entry. On success, 0 is returned. If zip or align is not valid, or the
+// entry's data has been started, then -1 is returned.
+int zip_align(ZIP *zip, unsigned align);
+
+// Make seek points in the compressed data of the subsequent entries after
+// every span bytes of uncompressed data, so that a reader can get a slice
+// from the middle of a large entry without inflating from the start. Each is
+// a full flush of deflate, after which raw inflate can start with no history.
+// The offsets of the seek points in the uncompressed and compressed data are
+// written as records in the index from zip_index(), if any. The compressed
+// offset is from the start of the deflate data, which for an encrypted entry
+// is after the salt and verifier. An encrypted entry can be decrypted from
+// there, since AES is in CTR mode. Each seek point costs about five bytes, and
+// the loss of the history for matches. span must be at least 65536, or 0 for
+// no seek points. This cannot be called during an entry. On success, 0 is
+// returned. If zip or span is not valid, then -1 is returned.
+int zip_points(ZIP *zip, uint64_t span);
+
+// Performance statistics for a zip stream, or for a single entry. The times
+// are in nanoseconds, measured with a monotonic clock sampled around each
+// read, CRC, deflate, and put() operation on a chunk of data, not per byte, so
+// the overhead is small enough to always keep the statistics. meta is the
+// memory currently used for metadata, in bytes, including the path name
+// buffer, the header list allocation, and the saved names. peak is the
+// largest meta has been.
+typedef struct {
+    uint64_t entries;       // number of entries completed
+    uint64_t ulen;          // total uncompressed bytes in completed entries
+    uint64_t clen;          // total compressed bytes in completed entries
+    uint64_t out;           // total bytes written, including headers
+    uint64_t opens;         // number of files opened for reading
+    uint64_t reads;         // number of fread() calls on input files
+    uint64_t puts;          // number of put() calls on the output
+    uint64_t syncs;         // number of full flushes from zip_rsync()
+    uint64_t read_ns;       // time spent reading input files
+    uint64_t crc_ns;        // time spent computing CRC-32s
+    uint64_t hash_ns;       // time spent computing zip_digest() digests
+    uint64_t crypt_ns;      // time spent on zip_encrypt() keys and encryption
+    uint64_t deflate_ns;    // time spent compressing
+    uint64_t put_ns;        // time spent writing the output
+    uint64_t diag[ZIP_DIAGS];   // number of diagnostics of each code
+    uint64_t meta;          // current metadata memory in bytes
+    uint64_t peak;          // peak metadata memory in bytes
+} zip_stats_t;
+
+// Copy the statistics of the zip stream so far to *stats. On success, 0 is
+// returned. If zip or stats are not valid, then -1 is returned.
+int zip_stats(ZIP *zip, zip_stats_t *stats);
+
+// Register the function track() to receive the statistics for each entry when
+// it is completed. name is the name of the entry in the zip file. entries in
+// *stats is 1, or 0 if the entry was omitted from the central directory due to
+// a read error. The times include all of the processing of the entry from
+// when it was started by zip_entry() or zip_meta(), and meta and peak are for
+// the stream as a whole. hook is passed to track() on each call. The previous
+// track() function can be unregistered by passing NULL for the function
+// pointer. On success, 0 is returned. If zip is not valid, then -1 is
+// returned.
+int zip_track(ZIP *zip, void *hook,
+              void (*track)(void *hook, char const *name,
+                            zip_stats_t const *stats));
+
+// Write a random-access index of the zip file to a second stream, using put()
+// as for zip_pipe(), with handle passed to it. With the index, a reader can
+// look up an entry by name and fetch its data from the zip file with a single
+// range request, without first reading the central directory at the end. A
+// record for each entry is written when the entry is complete. Entries
+// omitted from the central directory are not indexed. All integers are
+// little-endian, and all offsets are from the start of the zip file. The index
+// is an 8-byte header, "ZFIX", 1 (version), and three zeros, followed by
+// records. Each record starts with a one-byte type, and has its length in
+// bytes, including everything, at offset 4 as four bytes. Readers should skip
+// records of types they don't know. The records are:
+//
+//      for each entry, a 56-byte entry record followed by the name:
+//          1 byte: 1 (entry record type)
+//          1 byte: compression method as in the headers (0, 8, or 99)
+//          2 bytes: length of the name
+//          4 bytes: length of the record (56 plus the length of the name)
+//          4 bytes: CRC-32 as in the headers (0 for encrypted)
+//          2 bytes: general purpose bit flags as in the headers
+//          2 bytes: zero
+//          8 bytes: 64-bit FNV-1a hash of the name
+//          8 bytes: offset of the local header
+//          8 bytes: offset of the entry data
+//          8 bytes: length of the entry data (compressed length)
+//          8 bytes: uncompressed length
+//      for each seek point from zip_points(), a 32-byte seek point record,
+//      before the entry record for its entry:
+//          1 byte: 2 (seek point record type), and three zeros
+//          4 bytes: length of the record (32)
+//          8 bytes: offset in the entry's uncompressed data
+//          8 bytes: offset in the entry's compressed data
+//          8 bytes: offset of the entry's local header
+//      a 32-byte end record when the zip file is complete:
+//          1 byte: 3 (end record type), and three zeros
+//          4 bytes: length of the record (32)
+//          8 bytes: number of entries
+//          8 bytes: offset of the central directory
+//          8 bytes: length of the central directory and end records
+//
+// If put() returns 1, then the zip file is aborted as for a write error,
+// since the index would no longer match it. zip_index() can only be called
+// once, before anything is written. On success, 0 is returned. If zip or put
+// are not valid, or something has been written, then -1 is returned. If
+// put() fails, then 1 is returned.
+int zip_index(ZIP *zip, void *handle,
+              int (*put)(void *handle, void const *ptr, size_t len));
+
 // Complete the zip file by writing the zip directory at the end. Close the zip
 // object, freeing all allocated memory, including the object itself, which
 // cannot be used again after this. This flushes but does not close the output
@@ -183,6 +509,51 @@ int zip_data(ZIP *zip, void const *data, size_t len, int last);
 // returned.
 int zip_close(ZIP *zip);
 
+// Register process-wide memory allocation functions to be used by all zip
+// streams subsequently opened with zip_open(), zip_pipe(), or zip_append().
+// alloc() returns a pointer to size bytes of memory, and free() releases the
+// size bytes at ptr that were returned by alloc(). opaque is passed to both on
+// each call. This includes the input and output buffers and the deflate
+// engine allocated when a stream is opened, as well as the growing metadata
+// for the entries.
+// Each stream continues to use the functions in effect when it was opened,
+// until it is closed. Passing NULL for either function restores the use of
+// malloc() and free(). zip_memory() is not thread-safe, and should be called
+// before any streams are opened in other threads.
+//
+// This permits an application to enforce a single memory budget across many
+// concurrent streams. Since the memory for a stream's data is all allocated
+// when it is opened, an alloc() that waits until the budget permits the
+// allocation will hold back new streams until others have closed. As for
+// any other allocation failure, if alloc() returns NULL, zipflow will abort.
+void zip_memory(void *opaque, void *(*alloc)(void *opaque, size_t size),
+                void (*free)(void *opaque, void *ptr, size_t size));
+
+// Thread safety notes: A single ZIP * must only be used by one thread at a
+// time. Separate ZIP * instances share no state, and can be used concurrently
+// in different threads. An application with many streams can then run them
+// on its own executor or thread pool, with each stream's calls made in order
+// by whichever thread is running that stream. A stream can be suspended
+// between calls, e.g. between zip_data() calls, for fairness with the other
+// streams. (On Windows, zip_entry() sets the process locale to UTF-8, which
+// should be done by the application before starting any threads.)
+
+// Tracing notes: If zipflow.c is compiled with -DZIPFLOW_SDT, then static
+// tracepoints (USDT) are provided under the provider "zipflow", for use with
+// bpftrace, perf, and the like. This requires systemtap's sys/sdt.h. The
+// probes and their arguments are:
+//
+//      entry__start    name, level
+//      entry__done     name, uncompressed length, compressed length, omitted
+//      deflate__start  input bytes available, flush
+//      deflate__done   input bytes left, output bytes, deflate() return value
+//      put__start      length
+//      put__done       length, put() return value
+//      central__start  number of entries, central directory offset
+//      central__done   number of entries, length of directory and end records
+//
+// When not enabled by the compile option, the probes are not compiled in.
+
 // Error handling notes: All memory allocations are expected to succeed. The
 // code aborts immediately with an assert if an allocation or reallocation
 // fails. Similarly, the deflate() process and localtime() on the current time
@@ -192,3 +563,9 @@ int zip_close(ZIP *zip);
 // entry is omitted from the zip file central directory, and a warning message
 // is issued. The omission results in the corrupted entry being invisible to
 // unzip and other zip file access programs and libraries.
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+/* zipflow.hpp -- header-only C++20 interface to zipflow
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipflow.h
+ */
+
+// This wraps the zipflow C interface in a move-only RAII writer, with byte
+// spans for the data, and sinks that are any type with a put() member
+// function. There is nothing here beyond inline calls of the C functions, and
+// it does not throw. Compile your C++ code with -std=c++20 or later, and link
+// with zipflow.c compiled as C, and -lz.
+//
+//      struct counter {
+//          std::size_t total = 0;
+//          bool put(std::span<std::byte const> data) noexcept {
+//              total += data.size();
+//              return true;
+//          }
+//      };
+//
+//      counter out;
+//      zipflow::writer zip(out, 6);
+//      zip.meta("hello.txt", 0644, now, now);
+//      zip.data(std::as_bytes(std::span(text)), true);
+//      if (!zip.close())
+//          ...
+//
+// The sink's put() is called by a function instantiated for the sink type,
+// through which zipflow calls it, so put() can be inlined there. put() returns
+// true on success, or false to abort the stream. An optional flush() member
+// function, also returning true on success, is called when the zip file is
+// complete. The sink must outlive the writer.
+//
+// Results are returned as zipflow::status, which is std::expected<void,
+// zipflow::errc> if available (C++23), or else an equivalent minimal class.
+//
+// zipflow::stream() is a coroutine that produces a zip file lazily from a
+// range of in-memory sources, as a sequence of chunks:
+//
+//      std::vector<zipflow::source> files = ...;
+//      for (std::span<std::byte const> chunk : zipflow::stream(files))
+//          send(chunk);
+//
+// Each step of the iteration does only the compression needed to produce the
+// next chunk, in the calling thread, so an event loop or executor can
+// interleave many such streams on a few threads. When the iteration ends, the
+// generator's result() tells whether the chunks make up a complete zip file:
+//
+//      auto zip = zipflow::stream(files);
+//      for (std::span<std::byte const> chunk : zip)
+//          send(chunk);
+//      if (!zip.result())
+//          ...
+
+#ifndef ZIPFLOW_HPP
+#define ZIPFLOW_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <ranges>
+#include <vector>
+#if __has_include(<expected>)
+#  include <expected>
+#endif
+#include "zipflow.h"
+
+namespace zipflow {
+
+// Errors from the zipflow C functions.
+enum class errc {
+    invalid = -1,       // invalid argument or call sequence
+    write = 1           // write error or put() abort -- only close() is viable
+};
+
+#ifdef __cpp_lib_expected
+using status = std::expected<void, errc>;
+inline status result(int ret) noexcept {
+    if (ret == 0)
+        return {};
+    return std::unexpected(static_cast<errc>(ret));
+}
+#else
+// Minimal stand-in for std::expected<void, errc>.
+class status {
+public:
+    constexpr status() noexcept = default;
+    constexpr explicit status(errc err) noexcept : ok_(false), err_(err) {}
+    constexpr bool has_value() const noexcept { return ok_; }
+    constexpr explicit operator bool() const noexcept { return ok_; }
+    constexpr errc error() const noexcept { return err_; }
+private:
+    bool ok_ = true;
+    errc err_ = errc::invalid;
+};
+inline status result(int ret) noexcept {
+    return ret == 0 ? status() : status(static_cast<errc>(ret));
+}
+#endif
+
+// A sink for the zip file stream.
+template <class S>
+concept sink = requires(S& s, std::span<std::byte const> data) {
+    { s.put(data) } -> std::convertible_to<bool>;
+};
+
+// The put() function given to zip_pipe() for the sink type S.
+template <sink S>
+int trampoline(void *handle, void const *ptr, std::size_t len) noexcept {
+    S& s = *static_cast<S *>(handle);
+    if (ptr == nullptr) {
+        if constexpr (requires { { s.flush() } -> std::convertible_to<bool>; })
+            return s.flush() ? 0 : 1;
+        else
+            return 0;
+    }
+    return s.put(std::span<std::byte const>(
+               static_cast<std::byte const *>(ptr), len)) ? 0 : 1;
+}
+
+// zip_data() with a span of bytes.
+inline int zip_data(ZIP *zip, std::span<std::byte const> data,
+                    bool last) noexcept {
+    return ::zip_data(zip, data.data(), data.size(), last);
+}
+
+// Move-only owner of a zip stream. The stream is completed by close(), or by
+// the destructor, which discards the result. A default-constructed or
+// moved-from writer holds no stream, and its functions return errc::invalid.
+class writer {
+public:
+    writer() noexcept = default;
+
+    // Write the zip file to out. See zip_open().
+    explicit writer(std::FILE *out, int level = -1) noexcept
+        : zip_(zip_open(out, level)) {}
+
+    // Write the zip file to the sink s. See zip_pipe().
+    template <sink S>
+    explicit writer(S& s, int level = -1) noexcept
+        : zip_(zip_pipe(&s, trampoline<S>, level)) {}
+
+    // Add entries to the existing zip file in out. See zip_append().
+    static writer append(std::FILE *out, int level = -1) noexcept {
+        writer w;
+        w.zip_ = zip_append(out, level);
+        return w;
+    }
+
+    writer(writer const&) = delete;
+    writer& operator=(writer const&) = delete;
+    writer(writer&& other) noexcept
+        : zip_(std::exchange(other.zip_, nullptr)) {}
+    writer& operator=(writer&& other) noexcept {
+        if (this != &other) {
+            (void)close();
+            zip_ = std::exchange(other.zip_, nullptr);
+        }
+        return *this;
+    }
+    ~writer() { (void)close(); }
+
+    // True if there is a stream, i.e. the open succeeded and it has not been
+    // closed or moved from.
+    explicit operator bool() const noexcept { return zip_ != nullptr; }
+
+    // The underlying ZIP *, for the functions not wrapped here.
+    ZIP *get() const noexcept { return zip_; }
+
+    // See zip_entry().
+    status entry(char const *path) noexcept {
+        return result(zip_entry(zip_, path));
+    }
+
+    // See zip_meta(), with Unix attributes.
+    status meta(char const *path, unsigned mode, std::uint32_t atime,
+                std::uint32_t mtime) noexcept {
+        return result(zip_meta(zip_, path, 3, mode, atime, mtime));
+    }
+
+    // See zip_meta(), with Windows attributes.
+    status meta_windows(char const *path, std::uint32_t attr,
+                        std::uint64_t ctime, std::uint64_t atime,
+                        std::uint64_t mtime) noexcept {
+        return result(zip_meta(zip_, path, 10, attr, ctime, atime, mtime));
+    }
+
+    // See zip_data().
+    status data(std::span<std::byte const> data, bool last = false) noexcept {
+        return result(zipflow::zip_data(zip_, data, last));
+    }
+    status data(std::string_view text, bool last = false) noexcept {
+        return data(std::as_bytes(std::span(text)), last);
+    }
+
+    // See zip_known().
+    status known(std::uint64_t ulen, std::uint32_t crc,
+                 bool verify = true) noexcept {
+        return result(zip_known(zip_, ulen, crc, verify));
+    }
+
+    // See zip_raw().
+    status raw(std::span<std::byte const> comp, std::uint64_t ulen,
+               std::uint32_t crc) noexcept {
+        return result(zip_raw(zip_, comp.data(), comp.size(), ulen, crc));
+    }
+
+    // Complete the zip file and release the stream. See zip_close().
+    status close() noexcept {
+        return result(zip_close(std::exchange(zip_, nullptr)));
+    }
+
+private:
+    ZIP *zip_ = nullptr;
+};
+
+// Minimal C++20 generator of values of T, for stream(). T is expected to be
+// cheap to copy, such as a span. The coroutine ends with co_return of a
+// status, which is then available from result().
+template <class T>
+class generator {
+public:
+    struct promise_type {
+        T value{};
+        status ret{};
+        generator get_return_object() noexcept {
+            return generator(handle::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(T v) noexcept {
+            value = v;
+            return {};
+        }
+        void return_value(status s) noexcept { ret = s; }
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+    using handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        iterator() noexcept = default;
+        explicit iterator(handle h) noexcept : h_(h) {}
+        T const& operator*() const noexcept { return h_.promise().value; }
+        iterator& operator++() {
+            h_.resume();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const noexcept {
+            return h_.done();
+        }
+    private:
+        handle h_;
+    };
+
+    generator(generator const&) = delete;
+    generator& operator=(generator const&) = delete;
+    generator(generator&& other) noexcept
+        : h_(std::exchange(other.h_, nullptr)) {}
+    generator& operator=(generator&& other) noexcept {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    ~generator() {
+        if (h_)
+            h_.destroy();
+    }
+
+    // Start the coroutine, running it to its first chunk. begin() can only be
+    // called once.
+    iterator begin() {
+        h_.resume();
+        return iterator(h_);
+    }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+    // The status from the coroutine, valid once the iteration has ended.
+    status result() const noexcept { return h_.promise().ret; }
+
+private:
+    explicit generator(handle h) noexcept : h_(h) {}
+    handle h_;
+};
+
+// An in-memory source for stream(): the entry name, its data, and its Unix
+// permissions and modification time. name and data must remain valid while
+// the stream is being iterated.
+struct source {
+    std::string_view name;
+    std::span<std::byte const> data;
+    unsigned mode = 0644;
+    std::uint32_t mtime = 0;
+};
+
+namespace detail {
+    // Sink that collects the output of one zip_data() call. If the buffer
+    // cannot grow, then the stream is aborted, since put() must not throw.
+    struct staging {
+        std::vector<std::byte> buf;
+        bool put(std::span<std::byte const> data) noexcept {
+            try {
+                buf.insert(buf.end(), data.begin(), data.end());
+            }
+            catch (...) {
+                return false;
+            }
+            return true;
+        }
+    };
+}
+
+// Produce a zip file of the sources, compressed with level, as a sequence of
+// chunks. Each chunk is valid until the iteration is advanced. The data of
+// each source is fed to zip_data() in slices of at most slice bytes, and the
+// compressed output of each call, if any, is the next chunk. The staging
+// buffer holding a chunk is then bounded by the deflate output for a slice,
+// except for the last chunk, which is the central directory, and is
+// proportional to the number of entries, as is zipflow's metadata. Sources
+// with names that zip_meta() rejects are skipped, and the result() is then
+// errc::invalid, though the zip file of the other sources is complete. If the
+// stream cannot be started, then there are no chunks, and the result() is
+// errc::invalid. If zip_data() or zip_close() fails, e.g. when the staging
+// buffer cannot grow, then the iteration ends early, the chunks so far are not
+// a valid zip file, and the result() is that error.
+template <std::ranges::input_range R>
+    requires std::convertible_to<std::ranges::range_reference_t<R>, source>
+generator<std::span<std::byte const>> stream(R sources, int level = -1,
+                                             std::size_t slice = 65536) {
+    detail::staging out;
+    writer zip(out, level);
+    if (!zip || slice == 0)
+        co_return result(static_cast<int>(errc::invalid));
+    status skip{};
+    for (source src : sources) {
+        std::string name(src.name);
+        if (!zip.meta(name.c_str(), src.mode, src.mtime, src.mtime)) {
+            skip = result(static_cast<int>(errc::invalid));
+            continue;
+        }
+        std::span<std::byte const> data = src.data;
+        do {
+            std::size_t n = data.size() < slice ? data.size() : slice;
+            status ret = zip.data(data.first(n), n == data.size());
+            if (!ret)
+                co_return ret;
+            data = data.subspan(n);
+            if (!out.buf.empty()) {
+                co_yield std::span<std::byte const>(out.buf);
+                out.buf.clear();
+            }
+        } while (!data.empty());
+    }
+    status ret = zip.close();
+    if (!ret)
+        co_return ret;
+    if (!out.buf.empty())
+        co_yield std::span<std::byte const>(out.buf);
+    co_return skip;
+}
+
+}   // namespace zipflow
+
+#endif
@@ -6,9 +6,13 @@
 // Write a zip file to stdout containing the files named on the command line,
 // and any files contained at any level in the directories named on the command
 // line. Symbolic links are treated as the objects they link to. Non-regular
-// files (devices, pipes, sockets, etc.) are skipped.
+// files (devices, pipes, sockets, etc.) are skipped. If the SOURCE_DATE_EPOCH
+// environment variable is set, then the zip file is reproducible, with times
+// no later than that.
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include "zipflow.h"
 
 // Change the mode of an open file, like stdout, to binary in Windows.
@@ -21,8 +25,21 @@
 #endif
 
 int main(int argc, char **argv) {
+    char const *epoch = getenv("SOURCE_DATE_EPOCH");
+    long long limit = -1;
+    if (epoch != NULL && *epoch) {
+        char *end;
+        errno = 0;
+        limit = strtoll(epoch, &end, 10);
+        if (errno || *end || limit < 0) {
+            fprintf(stderr, "zips: invalid SOURCE_DATE_EPOCH: %s\n", epoch);
+            return 1;
+        }
+    }
     SET_BINARY_MODE(stdout);
     ZIP *zip = zip_open(stdout, -1);
+    if (epoch != NULL)
+        zip_fixed(zip, limit, 0);
     for (int i = 1; i < argc; i++)
         if (zip_entry(zip, argv[i]))
             break;